@@ -0,0 +1,91 @@
+#include "../mpc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+** Parse throughput over growing inputs. Time per byte should
+** stay flat from the smallest input to the largest one.
+*/
+
+static mpc_val_t *fold_discard(int n, mpc_val_t **xs) {
+  int i;
+  for (i = 0; i < n; i++) { free(xs[i]); }
+  return NULL;
+}
+
+static char *input_new(long size) {
+  
+  static const char *line = "amplitude_12 = 1234567;\n";
+  long len = strlen(line);
+  long n = size / len;
+  char *s = malloc(n * len + 1);
+  long i;
+  
+  for (i = 0; i < n; i++) { memcpy(s + i * len, line, len); }
+  s[n * len] = '\0';
+  return s;
+}
+
+int main(int argc, char **argv) {
+  
+  static const long sizes[] = { 1L << 10, 10L << 10, 100L << 10, 1L << 20, 10L << 20 };
+  static const char *modes[] = { "string", "file", "pipe" };
+  
+  mpc_parser_t *Stmt, *Prog;
+  mpc_result_t r;
+  unsigned int k;
+  
+  (void) argc; (void) argv;
+  
+  Stmt = mpc_apply(mpc_and(4, mpcf_strfold,
+    mpc_tok(mpc_ident()), mpc_sym("="), mpc_tok(mpc_digits()), mpc_sym(";"),
+    free, free, free), mpcf_free);
+  
+  Prog = mpc_whole(mpc_many(fold_discard, Stmt), free);
+  
+  printf("%6s %12s %12s %12s %12s\n", "input", "bytes", "seconds", "MB/s", "ns/byte");
+  
+  for (k = 0; k < 3 * sizeof(sizes) / sizeof(sizes[0]); k++) {
+    
+    int mode = k % 3;
+    char *input = input_new(sizes[k / 3]);
+    long len = strlen(input);
+    FILE *f = NULL;
+    clock_t start;
+    double secs;
+    int ok;
+    
+    if (mode != 0) {
+      f = tmpfile();
+      fwrite(input, 1, len, f);
+      rewind(f);
+    }
+    
+    start = clock();
+    switch (mode) {
+      case 0: ok = mpc_parse("<bench>", input, Prog, &r); break;
+      case 1: ok = mpc_parse_file("<bench>", f, Prog, &r); break;
+      default: ok = mpc_parse_pipe("<bench>", f, Prog, &r); break;
+    }
+    secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    
+    if (f) { fclose(f); }
+    free(input);
+    
+    if (!ok) {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+      mpc_delete(Prog);
+      return 1;
+    }
+    
+    printf("%6s %12ld %12.4f %12.2f %12.2f\n", modes[mode],
+      len, secs, secs > 0 ? len / secs / (1 << 20) : 0.0, secs * 1e9 / len);
+  }
+  
+  mpc_delete(Prog);
+  return 0;
+}
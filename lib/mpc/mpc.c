@@ -1,5 +1,172 @@
+#if !defined(_POSIX_C_SOURCE) && (defined(__unix__) || defined(__APPLE__))
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "mpc.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define MPC_USE_MMAP
+#define MPC_USE_THREADS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#endif
+
+/*
+** Threads
+**
+** Parsers are only read while parsing, so once a
+** grammar is built any number of threads can parse
+** with it at once. What global state there is, the
+** tag intern table and the regex cache, is guarded
+** by a lock, while the current arena and the caches
+** of tags are kept per thread.
+**
+** This needs both pthreads and thread local storage.
+** Without pthreads there is no lock at all and only
+** one thread may use mpc, so nothing is kept per
+** thread either. With pthreads but no known way to
+** declare thread local storage the build stops.
+*/
+
+#if defined(__GNUC__)
+#define MPC_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define MPC_THREAD_LOCAL __declspec(thread)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+#define MPC_THREAD_LOCAL _Thread_local
+#elif defined(MPC_USE_THREADS)
+#error "mpc: no thread local storage for this compiler, parsing from several threads would not be safe"
+#else
+#define MPC_THREAD_LOCAL
+#endif
+
+#ifdef MPC_USE_THREADS
+typedef pthread_mutex_t mpc_lock_t;
+#define MPC_LOCK_INIT PTHREAD_MUTEX_INITIALIZER
+static void mpc_lock(mpc_lock_t *l) { pthread_mutex_lock(l); }
+static void mpc_unlock(mpc_lock_t *l) { pthread_mutex_unlock(l); }
+#else
+typedef int mpc_lock_t;
+#define MPC_LOCK_INIT 0
+static void mpc_lock(mpc_lock_t *l) { (void) l; }
+static void mpc_unlock(mpc_lock_t *l) { (void) l; }
+#endif
+
+/*
+** Arena
+**
+** While a parse runs with an arena all results are
+** bump allocated from it: strings, folds and the AST.
+** Freeing them does nothing, everything goes away at
+** once with `mpc_arena_free`. Errors are not part of
+** the results and always live on the heap.
+**
+** Each block is preceded by its size so that `realloc`
+** knows how much to copy, and the most recent block is
+** grown in place when there is room for it.
+*/
+
+typedef union {
+  long l;
+  double d;
+  void *p;
+  size_t s;
+} mpc_arena_block_t;
+
+#define MPC_ARENA_HEAD (sizeof(mpc_arena_block_t))
+#define MPC_ARENA_CHUNK 65536
+
+struct mpc_arena_t {
+  char *chunks;
+  char *next;
+  char *end;
+  char *last;
+};
+
+static MPC_THREAD_LOCAL mpc_arena_t *mpc_arena_current = NULL;
+
+mpc_arena_t *mpc_arena_new(void) {
+  return calloc(1, sizeof(mpc_arena_t));
+}
+
+void mpc_arena_free(mpc_arena_t *a) {
+  char *c;
+  while (a->chunks) {
+    c = a->chunks;
+    a->chunks = *(char**)c;
+    free(c);
+  }
+  free(a);
+}
+
+static size_t mpc_arena_round(size_t n) {
+  return (n + MPC_ARENA_HEAD - 1) / MPC_ARENA_HEAD * MPC_ARENA_HEAD;
+}
+
+static void *mpc_arena_alloc(mpc_arena_t *a, size_t n) {
+  
+  size_t size;
+  char *c;
+  
+  n = mpc_arena_round(n);
+  
+  if (a->next == NULL || (size_t)(a->end - a->next) < MPC_ARENA_HEAD + n) {
+    size = MPC_ARENA_HEAD + n > MPC_ARENA_CHUNK ? MPC_ARENA_HEAD + n : MPC_ARENA_CHUNK;
+    c = malloc(MPC_ARENA_HEAD + size);
+    *(char**)c = a->chunks;
+    a->chunks = c;
+    a->next = c + MPC_ARENA_HEAD;
+    a->end = a->next + size;
+  }
+  
+  ((mpc_arena_block_t*)a->next)->s = n;
+  a->last = a->next + MPC_ARENA_HEAD;
+  a->next = a->last + n;
+  return a->last;
+}
+
+static void *mpc_arena_realloc(mpc_arena_t *a, void *p, size_t n) {
+  
+  mpc_arena_block_t *b;
+  void *q;
+  
+  if (p == NULL) { return mpc_arena_alloc(a, n); }
+  
+  b = (mpc_arena_block_t*)((char*)p - MPC_ARENA_HEAD);
+  if (n <= b->s) { return p; }
+  
+  if (p == a->last && (size_t)(a->end - a->last) >= mpc_arena_round(n)) {
+    b->s = mpc_arena_round(n);
+    a->next = a->last + b->s;
+    return p;
+  }
+  
+  q = mpc_arena_alloc(a, n);
+  memcpy(q, p, b->s);
+  return q;
+}
+
+static void *mpc_malloc(size_t n) {
+  return mpc_arena_current ? mpc_arena_alloc(mpc_arena_current, n) : malloc(n);
+}
+
+static void *mpc_calloc(size_t n, size_t m) {
+  void *p;
+  if (!mpc_arena_current) { return calloc(n, m); }
+  p = mpc_arena_alloc(mpc_arena_current, n * m);
+  memset(p, 0, n * m);
+  return p;
+}
+
+static void *mpc_realloc(void *p, size_t n) {
+  return mpc_arena_current ? mpc_arena_realloc(mpc_arena_current, p, n) : realloc(p, n);
+}
+
+static void mpc_free(void *p) {
+  if (!mpc_arena_current) { free(p); }
+}
+
 /*
 ** State Type
 */
@@ -21,7 +188,7 @@ static mpc_state_t mpc_state_new(void) {
 }
 
 static mpc_state_t *mpc_state_copy(mpc_state_t s) {
-  mpc_state_t *r = malloc(sizeof(mpc_state_t));
+  mpc_state_t *r = mpc_malloc(sizeof(mpc_state_t));
   memcpy(r, &s, sizeof(mpc_state_t));
   return r;
 }
@@ -60,6 +227,7 @@ static mpc_err_t *mpc_err_fail(const char *filename, mpc_state_t s, const char *
 void mpc_err_delete(mpc_err_t *x) {
 
   int i;
+  if (x == NULL) { return; }
   for (i = 0; i < x->expected_num; i++) {
     free(x->expected[i]);
   }
@@ -70,6 +238,32 @@ void mpc_err_delete(mpc_err_t *x) {
   free(x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  
+  int i;
+  mpc_err_t *y;
+  
+  if (x == NULL) { return NULL; }
+  
+  y = malloc(sizeof(mpc_err_t));
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->state = x->state;
+  y->expected_num = x->expected_num;
+  y->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (i = 0; i < x->expected_num; i++) {
+    y->expected[i] = malloc(strlen(x->expected[i]) + 1);
+    strcpy(y->expected[i], x->expected[i]);
+  }
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->recieved = x->recieved;
+  return y;
+}
+
 static int mpc_err_contains_expected(mpc_err_t *x, char *expected) {
   
   int i;
@@ -122,13 +316,12 @@ void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt, ...)
   va_end(va);
 }
 
-static char char_unescape_buffer[3];
-
-static const char *mpc_err_char_unescape(char c) {
+static const char *mpc_err_char_unescape(char c, char *buffer) {
   
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
+  buffer[0] = '\'';
+  buffer[1] = ' ';
+  buffer[2] = '\'';
+  buffer[3] = '\0';
   
   switch (c) {
     
@@ -142,8 +335,8 @@ static const char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[1] = c;
+      return buffer;
   }
   
 }
@@ -151,6 +344,7 @@ static const char *mpc_err_char_unescape(char c) {
 char *mpc_err_string(mpc_err_t *x) {
   
   char *buffer = calloc(1, 1024);
+  char received[4];
   int max = 1023;
   int pos = 0; 
   int i;
@@ -178,7 +372,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, "%s", mpc_err_char_unescape(x->recieved, received));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
@@ -322,13 +516,32 @@ typedef struct {
   char *buffer;
   FILE *file;
   
+  long length;
+  const char *end;
+  int borrowed;
+  
+  char *map;
+  long map_len;
+  
+  long buffer_pos;
+  long buffer_len;
+  long buffer_cap;
+  
   int backtrack;
   int marks_num;
+  int marks_slots;
   mpc_state_t* marks;
   char* lasts;
   
+  int cut;
+  int cut_failed;
+  
   char last;
   
+  struct mpc_lexer_t *lexer;
+  struct mpc_token_t *tokens;
+  struct mpc_stack_t *stacks;
+  
 } mpc_input_t;
 
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
@@ -341,18 +554,78 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->length = strlen(string);
+  i->string = malloc(i->length + 1);
+  memcpy(i->string, string, i->length + 1);
+  i->end = i->string + i->length;
+  i->borrowed = 0;
+  i->map = NULL;
+  i->map_len = 0;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_cap = 0;
+  i->buffer = NULL;
+  i->file = NULL;
+  
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->marks_slots = 0;
+  i->cut = 0;
+  i->cut_failed = 0;
+  i->marks = NULL;
+  i->lasts = NULL;
+
+  i->last = '\0';
+  
+  i->lexer = NULL;
+  i->tokens = NULL;
+  i->stacks = NULL;
+  
+  return i;
+}
+
+/*
+** Borrowed inputs read straight from memory owned by
+** the caller. They are never copied or freed and need
+** not be NUL terminated, the length marks the end.
+*/
+
+static mpc_input_t *mpc_input_new_borrowed(const char *filename, const char *ptr, long len) {
+
+  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  
+  i->filename = malloc(strlen(filename) + 1);
+  strcpy(i->filename, filename);
+  i->type = MPC_INPUT_STRING;
+  
+  i->state = mpc_state_new();
+  
+  i->string = (char *)ptr;
+  i->length = len;
+  i->end = ptr + len;
+  i->borrowed = 1;
+  i->map = NULL;
+  i->map_len = 0;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_cap = 0;
   i->buffer = NULL;
   i->file = NULL;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
+  i->cut = 0;
+  i->cut_failed = 0;
   i->marks = NULL;
   i->lasts = NULL;
 
   i->last = '\0';
   
+  i->lexer = NULL;
+  i->tokens = NULL;
+  i->stacks = NULL;
+  
   return i;
 }
 
@@ -370,17 +643,66 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->buffer = NULL;
   i->file = pipe;
   
+  i->length = 0;
+  i->end = NULL;
+  i->borrowed = 0;
+  i->map = NULL;
+  i->map_len = 0;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_cap = 0;
+  
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
+  i->cut = 0;
+  i->cut_failed = 0;
   i->marks = NULL;
   i->lasts = NULL;
   
   i->last = '\0';
   
+  i->lexer = NULL;
+  i->tokens = NULL;
+  i->stacks = NULL;
+  
   return i;
   
 }
 
+/*
+** Regular files are mapped into memory and read just
+** like a borrowed string. Only when that is not possible
+** do we fall back to going through stdio.
+*/
+
+#ifdef MPC_USE_MMAP
+static int mpc_input_map_file(mpc_input_t *i, FILE *file) {
+  
+  struct stat st;
+  long off;
+  char *map;
+  int fd = fileno(file);
+  
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { return 0; }
+  
+  off = ftell(file);
+  if (off < 0 || (long)st.st_size <= off) { return 0; }
+  
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) { return 0; }
+  
+  i->type = MPC_INPUT_STRING;
+  i->string = map + off;
+  i->length = st.st_size - off;
+  i->end = i->string + i->length;
+  i->borrowed = 1;
+  i->map = map;
+  i->map_len = st.st_size;
+  return 1;
+}
+#endif
+
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -394,43 +716,90 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->buffer = NULL;
   i->file = file;
   
+  i->length = 0;
+  i->end = NULL;
+  i->borrowed = 0;
+  i->map = NULL;
+  i->map_len = 0;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_cap = 0;
+  
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
+  i->cut = 0;
+  i->cut_failed = 0;
   i->marks = NULL;
   i->lasts = NULL;
   
   i->last = '\0';
   
+  i->lexer = NULL;
+  i->tokens = NULL;
+  i->stacks = NULL;
+  
+#ifdef MPC_USE_MMAP
+  mpc_input_map_file(i, file);
+#endif
+  
   return i;
 }
 
+static void mpc_stack_delete(struct mpc_stack_t *s);
+
 static void mpc_input_delete(mpc_input_t *i) {
   
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
+#ifdef MPC_USE_MMAP
+  /* Leave the file where stdio would have left it */
+  if (i->map) {
+    fseek(i->file, (long)(i->string - i->map) + i->state.pos, SEEK_SET);
+    munmap(i->map, i->map_len);
+  }
+#endif
+  
+  if (i->type == MPC_INPUT_STRING && !i->borrowed) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
+  mpc_stack_delete(i->stacks);
   free(i->marks);
   free(i->lasts);
+  free(i->tokens);
   free(i);
 }
 
 static void mpc_input_backtrack_disable(mpc_input_t *i) { i->backtrack--; }
 static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 
+static int mpc_input_buffer_in_range(mpc_input_t *i) {
+  return i->state.pos < i->buffer_pos + i->buffer_len;
+}
+
+static char mpc_input_buffer_get(mpc_input_t *i) {
+  return i->buffer[i->state.pos - i->buffer_pos];
+}
+
 static void mpc_input_mark(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
+  if (i->marks_num == i->marks_slots) {
+    i->marks_slots = i->marks_slots ? i->marks_slots * 2 : 32;
+    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
+    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
+  }
+  
   i->marks_num++;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+  if (i->type == MPC_INPUT_PIPE && i->marks_num - i->cut == 1 && !i->buffer) {
+    i->buffer_pos = i->state.pos;
+    i->buffer_len = 0;
+    i->buffer_cap = 64;
+    i->buffer = malloc(i->buffer_cap);
   }
   
 }
@@ -440,20 +809,54 @@ static void mpc_input_unmark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num--;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
+  if (i->cut > i->marks_num) { i->cut = i->marks_num; }
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
+  /* Characters read again after a rewind are still needed */
+  if (i->type == MPC_INPUT_PIPE && i->marks_num == i->cut
+  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
     free(i->buffer);
     i->buffer = NULL;
   }
   
 }
 
+/*
+** A cut commits to everything parsed so far. The marks
+** below it are kept for counting but the input can no
+** longer be rewound to them, so what was buffered for
+** them can go. Rewinding to one is recorded instead, as
+** the parse has failed.
+*/
+
+static void mpc_input_cut(mpc_input_t *i) {
+  
+  if (i->backtrack < 1) { return; }
+  
+  i->cut = i->marks_num;
+  
+  if (i->type == MPC_INPUT_PIPE && i->buffer) {
+    if (mpc_input_buffer_in_range(i)) {
+      i->buffer_len -= i->state.pos - i->buffer_pos;
+      memmove(i->buffer, i->buffer + (i->state.pos - i->buffer_pos), i->buffer_len);
+      i->buffer_pos = i->state.pos;
+    } else {
+      free(i->buffer);
+      i->buffer = NULL;
+    }
+  }
+  
+}
+
 static void mpc_input_rewind(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
+  if (i->marks_num <= i->cut) {
+    i->cut_failed = 1;
+    mpc_input_unmark(i);
+    return;
+  }
+  
   i->state = i->marks[i->marks_num-1];
   i->last  = i->lasts[i->marks_num-1];
   
@@ -464,16 +867,8 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
-}
-
-static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
-}
-
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->string + i->state.pos == i->end) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
   if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
   return 0;
@@ -485,7 +880,7 @@ static char mpc_input_getc(mpc_input_t *i) {
   
   switch (i->type) {
     
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
     
@@ -508,7 +903,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
   
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: 
       
       c = fgetc(i->file);
@@ -562,13 +957,23 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
+  if (i->type == MPC_INPUT_PIPE &&
+      i->buffer &&
+      !mpc_input_buffer_in_range(i) &&
+      i->marks_num == i->cut) {
+    free(i->buffer);
+    i->buffer = NULL;
+  }
+  
   if (i->type == MPC_INPUT_PIPE &&
       i->buffer &&
       !mpc_input_buffer_in_range(i)) {
     
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+    if (i->buffer_len == i->buffer_cap) {
+      i->buffer_cap *= 2;
+      i->buffer = realloc(i->buffer, i->buffer_cap);
+    }
+    i->buffer[i->buffer_len++] = c;
   }
   
   i->last = c;
@@ -581,7 +986,7 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   }
   
   if (o) {
-    (*o) = malloc(2);
+    (*o) = mpc_malloc(2);
     (*o)[0] = c;
     (*o)[1] = '\0';
   }
@@ -601,22 +1006,10 @@ static int mpc_input_char(mpc_input_t *i, char c, char **o) {
   return x == c ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
-static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
-  char x = mpc_input_getc(i);
-  if (mpc_input_terminated(i)) { return 0; }
-  return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
-}
-
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
-  char x = mpc_input_getc(i);
-  if (mpc_input_terminated(i)) { return 0; }
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
-}
-
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_charset(mpc_input_t *i, const unsigned char *c, char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { return 0; }
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+  return c[(unsigned char)x >> 3] & (1 << ((unsigned char)x & 7)) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -627,14 +1020,11 @@ static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
 
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   
-  char *co = NULL;
   const char *x = c;
 
   mpc_input_mark(i);
   while (*x) {
-    if (mpc_input_char(i, *x, &co)) {
-      free(co);
-    } else {
+    if (!mpc_input_char(i, *x, NULL)) {
       mpc_input_rewind(i);
       return 0;
     }
@@ -642,8 +1032,10 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
   
-  *o = malloc(strlen(c) + 1);
-  strcpy(*o, c);
+  if (o) {
+    *o = mpc_malloc(strlen(c) + 1);
+    strcpy(*o, c);
+  }
   return 1;
 }
 
@@ -683,7 +1075,13 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_DFA       = 25,
+  MPC_TYPE_RUN       = 26,
+  MPC_TYPE_TOKEN     = 27,
+  MPC_TYPE_EXPR      = 28,
+  MPC_TYPE_CUT       = 29
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -691,9 +1089,9 @@ typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
 typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
 typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
 typedef struct { char x; } mpc_pdata_single_t;
-typedef struct { char x; char y; } mpc_pdata_range_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
 typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct { char *x; unsigned char s[32]; } mpc_pdata_charset_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
 typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
@@ -701,6 +1099,10 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { struct mpc_dfa_t *d; mpc_parser_t *x; } mpc_pdata_dfa_t;
+typedef struct { struct mpc_run_t *r; mpc_parser_t *x; } mpc_pdata_run_t;
+typedef struct { struct mpc_lexer_t *l; int id; char blank; mpc_parser_t *x; char *m; } mpc_pdata_token_t;
+typedef struct { int n; mpc_parser_t *x; mpc_parser_t **ops; mpc_op_t *table; mpc_dtor_t dop; } mpc_pdata_expr_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -708,9 +1110,9 @@ typedef union {
   mpc_pdata_expect_t expect;
   mpc_pdata_anchor_t anchor;
   mpc_pdata_single_t single;
-  mpc_pdata_range_t range;
   mpc_pdata_satisfy_t satisfy;
   mpc_pdata_string_t string;
+  mpc_pdata_charset_t charset;
   mpc_pdata_apply_t apply;
   mpc_pdata_apply_to_t apply_to;
   mpc_pdata_predict_t predict;
@@ -718,294 +1120,1377 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
+  mpc_pdata_run_t run;
+  mpc_pdata_token_t token;
+  mpc_pdata_expr_t expr;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
   char retained;
+  char span;
+  char memo;
+  char nullable;
+  char first_known;
+  unsigned char first[32];
   char *name;
   char type;
   mpc_pdata_t data;
 };
 
 /*
-** Stack Type
+** DFA Scanning
+**
+** Regexes made of character classes with repeats are
+** compiled into a table with one row of 256 entries
+** per state. Each entry is the next state after taking
+** that character, or says the match stops before it,
+** or that it fails. `eof` says whether the match holds
+** if the input ends in that state. Tables are shared
+** by all parsers built from the same regex string.
 */
 
-typedef struct {
-
-  int parsers_num;
-  int parsers_slots;
-  mpc_parser_t **parsers;
-  int *states;
+enum {
+  MPC_DFA_STOP = -1,
+  MPC_DFA_FAIL = -2
+};
 
-  int results_num;
-  int results_slots;
-  mpc_result_t *results;
-  int *returns;
+typedef struct mpc_dfa_t {
+  char *re;
+  int refs;
+  int states;
+  short *trans;
+  char *eof;
+  struct mpc_dfa_t *next;
+} mpc_dfa_t;
+
+/* Moves a string input on to `pos`, copying what was passed over into `o` */
+static void mpc_input_advance(mpc_input_t *i, long pos, char **o) {
+  
+  long k;
+  
+  for (k = i->state.pos; k < pos; k++) {
+    i->state.col++;
+    if (i->string[k] == '\n') {
+      i->state.col = 0;
+      i->state.row++;
+    }
+  }
   
-  mpc_err_t *err;
+  if (pos > i->state.pos) { i->last = i->string[pos-1]; }
   
-} mpc_stack_t;
+  if (o) {
+    *o = mpc_malloc(pos - i->state.pos + 1);
+    memcpy(*o, i->string + i->state.pos, pos - i->state.pos);
+    (*o)[pos - i->state.pos] = '\0';
+  }
+  
+  i->state.pos = pos;
+}
 
-static mpc_stack_t *mpc_stack_new(const char *filename) {
-  mpc_stack_t *s = malloc(sizeof(mpc_stack_t));
+static int mpc_input_dfa(mpc_input_t *i, mpc_dfa_t *d, char **o) {
   
-  s->parsers_num = 0;
-  s->parsers_slots = 0;
-  s->parsers = NULL;
-  s->states = NULL;
+  const short *trans = d->trans;
+  const char *str = i->string;
+  long pos = i->state.pos, end = i->length;
+  int s = 0, t = MPC_DFA_STOP;
   
-  s->results_num = 0;
-  s->results_slots = 0;
-  s->results = NULL;
-  s->returns = NULL;
+  while (pos < end) {
+    t = trans[s * 256 + (unsigned char)str[pos]];
+    if (t < 0) { break; }
+    s = t;
+    pos++;
+  }
   
-  s->err = mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
+  if (pos == end ? !d->eof[s] : t == MPC_DFA_FAIL) { return 0; }
   
-  return s;
+  mpc_input_advance(i, pos, o);
+  return 1;
 }
 
-static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
-  mpc_err_t *errs[2];
-  errs[0] = s->err;
-  errs[1] = e;
-  s->err = mpc_err_or(errs, 2);
-}
+/*
+** Run Scanning
+**
+** Runs of characters from one class, such as the
+** whitespace skipped after every token, are scanned
+** in a single loop. When the class is made of a few
+** ranges of characters, blocks of input are tested
+** against each range at once with SSE2 or AVX2 and
+** the first character outside the class is found
+** from the compare mask. The remaining input, or all
+** of it without SIMD, is tested against the bitmap.
+*/
 
-static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
-  int success = s->returns[0];
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MPC_RUN_SIMD 32
+typedef __m256i mpc_vec_t;
+#define mpc_vec_set(c) _mm256_set1_epi8((char)(c))
+#define mpc_vec_load(x) _mm256_loadu_si256((const __m256i*)(x))
+#define mpc_vec_zero() _mm256_setzero_si256()
+#define mpc_vec_sub(x, y) _mm256_sub_epi8(x, y)
+#define mpc_vec_subs(x, y) _mm256_subs_epu8(x, y)
+#define mpc_vec_or(x, y) _mm256_or_si256(x, y)
+#define mpc_vec_eq(x, y) _mm256_cmpeq_epi8(x, y)
+#define mpc_vec_mask(x) ((unsigned int)_mm256_movemask_epi8(x))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define MPC_RUN_SIMD 16
+typedef __m128i mpc_vec_t;
+#define mpc_vec_set(c) _mm_set1_epi8((char)(c))
+#define mpc_vec_load(x) _mm_loadu_si128((const __m128i*)(x))
+#define mpc_vec_zero() _mm_setzero_si128()
+#define mpc_vec_sub(x, y) _mm_sub_epi8(x, y)
+#define mpc_vec_subs(x, y) _mm_subs_epu8(x, y)
+#define mpc_vec_or(x, y) _mm_or_si128(x, y)
+#define mpc_vec_eq(x, y) _mm_cmpeq_epi8(x, y)
+#define mpc_vec_mask(x) ((unsigned int)_mm_movemask_epi8(x))
+#endif
+
+#define MPC_RUN_RANGES 4
+
+typedef struct mpc_run_t {
+  unsigned char set[32];
+  int ranges;
+  unsigned char lo[MPC_RUN_RANGES];
+  unsigned char len[MPC_RUN_RANGES];
+  char drop;
+} mpc_run_t;
+
+static int mpc_run_has(const mpc_run_t *r, char c) {
+  return r->set[(unsigned char)c >> 3] & (1 << ((unsigned char)c & 7));
+}
+
+static long mpc_run_scan(const mpc_run_t *r, const char *str, long pos, long end, long *rows, long *nl) {
+  
+#ifdef MPC_RUN_SIMD
+  int k;
+  unsigned int m, l, n;
+  mpc_vec_t x, in, lo[MPC_RUN_RANGES], len[MPC_RUN_RANGES];
+  mpc_vec_t zero = mpc_vec_zero();
+  mpc_vec_t newline = mpc_vec_set('\n');
+  
+  for (k = 0; k < r->ranges; k++) {
+    lo[k] = mpc_vec_set(r->lo[k]);
+    len[k] = mpc_vec_set(r->len[k]);
+  }
   
-  if (success) {
-    r->output = s->results[0].output;
-    mpc_err_delete(s->err);
-  } else {
-    mpc_stack_err(s, s->results[0].error);
-    r->error = s->err;
+  while (r->ranges > 0 && end - pos >= MPC_RUN_SIMD) {
+    
+    /* c is in [lo, lo+len] when (c - lo) saturating minus len is zero */
+    x = mpc_vec_load(str + pos);
+    in = zero;
+    for (k = 0; k < r->ranges; k++) {
+      in = mpc_vec_or(in, mpc_vec_eq(mpc_vec_subs(mpc_vec_sub(x, lo[k]), len[k]), zero));
+    }
+    
+    m = ~mpc_vec_mask(in);
+    n = m ? (unsigned int)__builtin_ctz(m) : MPC_RUN_SIMD;
+    
+    l = mpc_vec_mask(mpc_vec_eq(x, newline));
+    if (n < 32) { l &= (1u << n) - 1; }
+    if (l) {
+      *rows += __builtin_popcount(l);
+      *nl = pos + 31 - __builtin_clz(l);
+    }
+    
+    pos += n;
+    if (n < MPC_RUN_SIMD) { return pos; }
   }
+#endif
   
-  free(s->parsers);
-  free(s->states);
-  free(s->results);
-  free(s->returns);
-  free(s);
+  while (pos < end && mpc_run_has(r, str[pos])) {
+    if (str[pos] == '\n') { (*rows)++; *nl = pos; }
+    pos++;
+  }
   
-  return success;
-}
-
-/* Stack Parser Stuff */
-
-static void mpc_stack_set_state(mpc_stack_t *s, int x) {
-  s->states[s->parsers_num-1] = x;
+  return pos;
 }
 
-static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
-  if (s->parsers_num > s->parsers_slots) {
-    s->parsers_slots = ceil((s->parsers_slots+1) * 1.5);
-    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
+static void mpc_input_run(mpc_input_t *i, mpc_run_t *r, char **o) {
+  
+  long rows = 0, nl = -1;
+  long start = i->state.pos;
+  long pos = mpc_run_scan(r, i->string, start, i->length, &rows, &nl);
+  
+  if (nl >= 0) {
+    i->state.row += rows;
+    i->state.col = pos - nl - 1;
+  } else {
+    i->state.col += pos - start;
+  }
+  
+  if (pos > start) { i->last = i->string[pos-1]; }
+  
+  if (o && !r->drop) {
+    *o = mpc_malloc(pos - start + 1);
+    memcpy(*o, i->string + start, pos - start);
+    (*o)[pos - start] = '\0';
   }
+  
+  i->state.pos = pos;
 }
 
-static void mpc_stack_parsers_reserve_less(mpc_stack_t *s) {
-  if (s->parsers_slots > pow(s->parsers_num+1, 1.5)) {
-    s->parsers_slots = floor((s->parsers_slots-1) * (1.0/1.5));
-    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
+static void mpc_run_init(mpc_run_t *r, const char *s) {
+  
+  int c, k;
+  
+  memset(r, 0, sizeof(mpc_run_t));
+  while (*s) { r->set[(unsigned char)*s >> 3] |= 1 << ((unsigned char)*s & 7); s++; }
+  
+  for (c = 1; c < 256; c++) {
+    if (!mpc_run_has(r, (char)c)) { continue; }
+    if (r->ranges > 0 && r->lo[r->ranges-1] + r->len[r->ranges-1] + 1 == c) {
+      r->len[r->ranges-1]++;
+      continue;
+    }
+    if (r->ranges == MPC_RUN_RANGES) { r->ranges = -1; break; }
+    k = r->ranges++;
+    r->lo[k] = (unsigned char)c;
+    r->len[k] = 0;
   }
+  
+  if (r->ranges < 0) { r->ranges = 0; }
 }
 
-static void mpc_stack_pushp(mpc_stack_t *s, mpc_parser_t *p) {
-  s->parsers_num++;
-  mpc_stack_parsers_reserve_more(s);
-  s->parsers[s->parsers_num-1] = p;
-  s->states[s->parsers_num-1] = 0;
-}
+/*
+** Lexing
+**
+** Grammars built with `MPCA_LANG_LEXER` match their
+** terminals as tokens. The first time any terminal is
+** tried at a position of a string input, every terminal
+** that can start with the next character is matched
+** there and the token is the longest match. Ties go to
+** literal terminals, such as strings, chars and regexes
+** without special characters, and then to whichever
+** terminal comes first in the grammar. The result is
+** kept in a table indexed by position, so when the
+** parser backtracks and tries other terminals at the
+** same place each one is a single lookup.
+*/
 
-static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
-  *p = s->parsers[s->parsers_num-1];
-  *st = s->states[s->parsers_num-1];
-  s->parsers_num--;
-  mpc_stack_parsers_reserve_less(s);
-}
+typedef struct mpc_lexer_t {
+  int refs;
+  int num;
+  char **texts;
+  char *literal;
+  mpc_parser_t **res;
+  mpc_run_t blank;
+} mpc_lexer_t;
 
-static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
-  *p = s->parsers[s->parsers_num-1];
-  *st = s->states[s->parsers_num-1];
-}
+typedef struct mpc_token_t {
+  int id;
+  int len;
+} mpc_token_t;
 
-static int mpc_stack_empty(mpc_stack_t *s) {
-  return s->parsers_num == 0;
-}
+enum {
+  MPC_TOKEN_UNKNOWN = 0,
+  MPC_TOKEN_NONE    = -1
+};
 
-/* Stack Result Stuff */
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final, int fast);
 
-static mpc_result_t mpc_result_err(mpc_err_t *e) {
+static long mpc_lexer_match(mpc_lexer_t *l, int t, mpc_input_t *i) {
+  
+  long len, n = strlen(l->texts[t]);
+  mpc_state_t state = i->state;
+  char last = i->last;
+  mpc_parser_t *re = l->res[t];
   mpc_result_t r;
-  r.error = e;
-  return r;
+  
+  if (l->literal[t]) {
+    return i->length - i->state.pos >= n
+      && memcmp(i->string + i->state.pos, l->texts[t], n) == 0 ? n : 0;
+  }
+  
+  if (re->type == MPC_TYPE_DFA) {
+    len = mpc_input_dfa(i, re->data.dfa.d, NULL) ? i->state.pos - state.pos : 0;
+  } else if (mpc_parse_run(i, re, &r, 1)) {
+    len = i->state.pos - state.pos;
+    mpc_free(r.output);
+  } else {
+    len = 0;
+    mpc_err_delete(r.error);
+  }
+  
+  i->state = state;
+  i->last = last;
+  return len;
 }
 
-static mpc_result_t mpc_result_out(mpc_val_t *x) {
-  mpc_result_t r;
-  r.output = x;
-  return r;
+static mpc_token_t *mpc_input_token(mpc_input_t *i, mpc_lexer_t *l) {
+  
+  int t;
+  long len;
+  unsigned char c;
+  mpc_token_t *k;
+  
+  if (i->lexer != l) {
+    free(i->tokens);
+    i->lexer = l;
+    i->tokens = calloc(i->length + 1, sizeof(mpc_token_t));
+  }
+  
+  k = &i->tokens[i->state.pos];
+  if (k->id != MPC_TOKEN_UNKNOWN) { return k; }
+  
+  k->id = MPC_TOKEN_NONE;
+  k->len = 0;
+  if (i->state.pos == i->length) { return k; }
+  
+  c = (unsigned char)i->string[i->state.pos];
+  
+  for (t = 0; t < l->num; t++) {
+    if (l->literal[t] ? (unsigned char)l->texts[t][0] != c
+      : !(l->res[t]->first[c >> 3] & (1 << (c & 7)))) { continue; }
+    len = mpc_lexer_match(l, t, i);
+    if (len > k->len || (len > 0 && len == k->len && l->literal[t] && !l->literal[k->id-1])) {
+      k->id = t+1;
+      k->len = len;
+    }
+  }
+  
+  return k;
 }
 
-static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
-  if (s->results_num > s->results_slots) {
-    s->results_slots = ceil((s->results_slots + 1) * 1.5);
-    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
-    s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
-  }
+/* Names the token the lexer found so it can be told apart from the terminal */
+static mpc_err_t *mpc_err_token(mpc_input_t *i, const char *m, mpc_token_t *k) {
+  
+  mpc_err_t *e;
+  char *expected;
+  int len = k->len > 32 ? 32 : (int)k->len;
+  
+  if (k->len == 0) { return mpc_err_new(i->filename, i->state, m, mpc_input_peekc(i)); }
+  
+  expected = malloc(strlen(m) + len + 32);
+  sprintf(expected, "%s (found token '%.*s%s')", m, len, i->string + i->state.pos, k->len > 32 ? "..." : "");
+  e = mpc_err_new(i->filename, i->state, expected, mpc_input_peekc(i));
+  free(expected);
+  return e;
 }
 
-static void mpc_stack_results_reserve_less(mpc_stack_t *s) {
-  if ( s->results_slots > pow(s->results_num+1, 1.5)) {
-    s->results_slots = floor((s->results_slots-1) * (1.0/1.5));
-    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
-    s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
+static mpc_lexer_t *mpc_lexer_new(void) {
+  mpc_lexer_t *l = malloc(sizeof(mpc_lexer_t));
+  l->refs = 1;
+  l->num = 0;
+  l->texts = NULL;
+  l->literal = NULL;
+  l->res = NULL;
+  mpc_run_init(&l->blank, " \f\n\r\t\v");
+  return l;
+}
+
+static void mpc_lexer_release(mpc_lexer_t *l) {
+  
+  int t;
+  
+  if (l == NULL || --l->refs > 0) { return; }
+  
+  for (t = 0; t < l->num; t++) {
+    free(l->texts[t]);
+    if (l->res[t]) { mpc_delete(l->res[t]); }
   }
+  
+  free(l->texts);
+  free(l->literal);
+  free(l->res);
+  free(l);
 }
 
-static void mpc_stack_pushr(mpc_stack_t *s, mpc_result_t x, int r) {
-  s->results_num++;
-  mpc_stack_results_reserve_more(s);
-  s->results[s->results_num-1] = x;
-  s->returns[s->results_num-1] = r;
+/*
+** A parser is a span parser when its output is always
+** exactly the input it consumed, e.g. single characters
+** or `mpcf_strfold` over other span parsers. While such
+** a parser runs, none of the parsers below it build any
+** output. The outermost one copies the whole span out of
+** the input in one go when it succeeds.
+**
+** Retained parsers are never looked into so the check
+** cannot recurse forever.
+*/
+
+static int mpc_span_child(mpc_parser_t *x) {
+  return !x->retained && x->span;
 }
 
-static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
-  int r;
-  *x = s->results[s->results_num-1];
-  r = s->returns[s->results_num-1];
-  s->results_num--;
-  mpc_stack_results_reserve_less(s);
-  return r;
+static void mpc_span_check(mpc_parser_t *p) {
+  
+  int i;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_STRING:
+    case MPC_TYPE_DFA:
+      p->span = 1; break;
+    
+    case MPC_TYPE_RUN:
+      p->span = !p->data.run.r->drop; break;
+    
+    case MPC_TYPE_TOKEN:
+      p->span = mpc_span_child(p->data.token.x); break;
+    
+    case MPC_TYPE_LIFT:
+      p->span = p->data.lift.lf == mpcf_ctor_str; break;
+    
+    case MPC_TYPE_EXPECT:
+      p->span = mpc_span_child(p->data.expect.x); break;
+    
+    case MPC_TYPE_MAYBE:
+      p->span = p->data.not.lf == mpcf_ctor_str
+        && mpc_span_child(p->data.not.x); break;
+    
+    case MPC_TYPE_NOT:
+      p->span = p->data.not.lf == mpcf_ctor_str
+        && p->data.not.dx == free
+        && mpc_span_child(p->data.not.x); break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      p->span = p->data.repeat.f == mpcf_strfold
+        && mpc_span_child(p->data.repeat.x); break;
+    
+    case MPC_TYPE_COUNT:
+      p->span = p->data.repeat.f == mpcf_strfold
+        && p->data.repeat.dx == free
+        && mpc_span_child(p->data.repeat.x); break;
+    
+    case MPC_TYPE_OR:
+      p->span = 1;
+      for (i = 0; i < p->data.or.n; i++) {
+        if (!mpc_span_child(p->data.or.xs[i])) { p->span = 0; }
+      }
+      break;
+    
+    case MPC_TYPE_AND:
+      p->span = p->data.and.f == mpcf_strfold;
+      for (i = 0; i < p->data.and.n; i++) {
+        if (!mpc_span_child(p->data.and.xs[i])) { p->span = 0; }
+      }
+      for (i = 0; i < p->data.and.n-1; i++) {
+        if (p->data.and.dxs[i] != free) { p->span = 0; }
+      }
+      break;
+    
+    default:
+      p->span = 0; break;
+  }
+  
 }
 
-static int mpc_stack_peekr(mpc_stack_t *s, mpc_result_t *x) {
-  *x = s->results[s->results_num-1];
-  return s->returns[s->results_num-1];
+/*
+** FIRST sets
+**
+** For every parser in a grammar this finds whether it
+** can succeed without consuming input (`nullable`) and
+** which characters it can start with (`first`). With
+** these an `or` can skip any alternative which cannot
+** start with the next character of the input.
+**
+** Grammars are cyclic, so the sets are grown from empty
+** until a whole pass over the grammar changes nothing.
+*/
+
+static void mpc_first_add(mpc_parser_t *p, int c) {
+  p->first[(unsigned char)c >> 3] |= 1 << ((unsigned char)c & 7);
 }
 
-static void mpc_stack_popr_err(mpc_stack_t *s, int n) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    mpc_stack_err(s, x.error);
-    n--;
+static int mpc_first_has(mpc_parser_t *p, char c) {
+  return p->first[(unsigned char)c >> 3] & (1 << ((unsigned char)c & 7));
+}
+
+static int mpc_first_union(mpc_parser_t *p, mpc_parser_t *x) {
+  int j, changed = 0;
+  for (j = 0; j < 32; j++) {
+    if ((p->first[j] | x->first[j]) != p->first[j]) {
+      p->first[j] |= x->first[j];
+      changed = 1;
+    }
   }
+  return changed;
 }
 
-static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    ds[n-1](x.output);
-    n--;
+static void mpc_first_chars(mpc_parser_t *p) {
+  
+  int c;
+  char x;
+  
+  for (c = 0; c < 256; c++) {
+    x = (char)c;
+    switch (p->type) {
+      case MPC_TYPE_ANY:
+      case MPC_TYPE_SATISFY: mpc_first_add(p, x); break;
+      case MPC_TYPE_SINGLE:  if (x == p->data.single.x) { mpc_first_add(p, x); } break;
+      case MPC_TYPE_DFA:
+        if (p->data.dfa.d->trans[c] >= 0) { mpc_first_add(p, x); }
+        if (p->data.dfa.d->trans[c] == MPC_DFA_STOP) { p->nullable = 1; }
+        break;
+      default: break;
+    }
+  }
+  
+  if (p->type == MPC_TYPE_DFA && p->data.dfa.d->eof[0]) { p->nullable = 1; }
+  
+  if (p->type == MPC_TYPE_RANGE
+  ||  p->type == MPC_TYPE_ONEOF
+  ||  p->type == MPC_TYPE_NONEOF) {
+    for (c = 0; c < 32; c++) { p->first[c] |= p->data.charset.s[c]; }
+  }
+  
+  if (p->type == MPC_TYPE_RUN) {
+    for (c = 0; c < 32; c++) { p->first[c] |= p->data.run.r->set[c]; }
+    p->nullable = 1;
   }
+  
 }
 
-static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_dtor_t dx) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    dx(x.output);
-    n--;
+static void mpc_first_collect(mpc_parser_t *p, mpc_parser_t ***ps, int *n) {
+  
+  int j;
+  
+  if (p->first_known == 2) { return; }
+  p->first_known = 2;
+  p->nullable = 0;
+  memset(p->first, 0, sizeof(p->first));
+  
+  *ps = realloc(*ps, sizeof(mpc_parser_t*) * (*n + 1));
+  (*ps)[(*n)++] = p;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_DFA:
+    case MPC_TYPE_RUN:
+      mpc_first_chars(p); break;
+    
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0] == '\0') { p->nullable = 1; }
+      else { mpc_first_add(p, p->data.string.x[0]); }
+      break;
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_CUT:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+      p->nullable = 1; break;
+    
+    case MPC_TYPE_EXPECT:   mpc_first_collect(p->data.expect.x, ps, n); break;
+    case MPC_TYPE_APPLY:    mpc_first_collect(p->data.apply.x, ps, n); break;
+    case MPC_TYPE_APPLY_TO: mpc_first_collect(p->data.apply_to.x, ps, n); break;
+    case MPC_TYPE_PREDICT:  mpc_first_collect(p->data.predict.x, ps, n); break;
+    case MPC_TYPE_TOKEN:    mpc_first_collect(p->data.token.x, ps, n); break;
+    
+    case MPC_TYPE_EXPR:
+      mpc_first_collect(p->data.expr.x, ps, n);
+      for (j = 0; j < p->data.expr.n; j++) { mpc_first_collect(p->data.expr.ops[j], ps, n); }
+      break;
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      mpc_first_collect(p->data.not.x, ps, n); break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_first_collect(p->data.repeat.x, ps, n); break;
+    
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) { mpc_first_collect(p->data.or.xs[j], ps, n); }
+      break;
+    
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) { mpc_first_collect(p->data.and.xs[j], ps, n); }
+      break;
+    
+    default: break;
   }
+  
 }
 
-static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    n--;
+static int mpc_first_step(mpc_parser_t *p) {
+  
+  int j, nullable = p->nullable, changed = 0;
+  mpc_parser_t *x = NULL;
+  
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   x = p->data.expect.x; break;
+    case MPC_TYPE_APPLY:    x = p->data.apply.x; break;
+    case MPC_TYPE_APPLY_TO: x = p->data.apply_to.x; break;
+    case MPC_TYPE_PREDICT:  x = p->data.predict.x; break;
+    case MPC_TYPE_TOKEN:    x = p->data.token.x; break;
+    case MPC_TYPE_EXPR:     x = p->data.expr.x; break;
+    case MPC_TYPE_MANY1:    x = p->data.repeat.x; break;
+    
+    /* Succeed without input, but may still consume some */
+    case MPC_TYPE_MAYBE: x = p->data.not.x; nullable = 1; break;
+    case MPC_TYPE_MANY:  x = p->data.repeat.x; nullable = 1; break;
+    
+    /* Never consumes input when it succeeds */
+    case MPC_TYPE_NOT:
+      nullable = 1; break;
+    
+    case MPC_TYPE_COUNT:
+      x = p->data.repeat.x;
+      if (p->data.repeat.n == 0) { nullable = 1; x = NULL; }
+      break;
+    
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { nullable = 1; }
+      for (j = 0; j < p->data.or.n; j++) {
+        changed |= mpc_first_union(p, p->data.or.xs[j]);
+        nullable |= p->data.or.xs[j]->nullable;
+      }
+      break;
+    
+    case MPC_TYPE_AND:
+      nullable = 1;
+      for (j = 0; j < p->data.and.n && nullable; j++) {
+        changed |= mpc_first_union(p, p->data.and.xs[j]);
+        nullable = p->data.and.xs[j]->nullable;
+      }
+      break;
+    
+    default: break;
   }
+  
+  if (x) {
+    changed |= mpc_first_union(p, x);
+    nullable |= x->nullable;
+  }
+  
+  if (nullable != p->nullable) {
+    p->nullable = nullable;
+    changed = 1;
+  }
+  
+  return changed;
 }
 
-static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
-  mpc_val_t *x = f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
-  mpc_stack_popr_n(s, n);
-  return x;
+static void mpc_first_compute(int n, mpc_parser_t **rules) {
+  
+  int j, ps_num = 0, changed = 1;
+  mpc_parser_t **ps = NULL;
+  
+  for (j = 0; j < n; j++) { mpc_first_collect(rules[j], &ps, &ps_num); }
+  
+  while (changed) {
+    changed = 0;
+    for (j = 0; j < ps_num; j++) { changed |= mpc_first_step(ps[j]); }
+  }
+  
+  for (j = 0; j < ps_num; j++) { ps[j]->first_known = 1; }
+  free(ps);
 }
 
-static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
-  mpc_err_t *x = mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
-  mpc_stack_popr_n(s, n);
-  return x;
+/* Unknown parsers are always worth a try */
+static int mpc_first_viable(mpc_parser_t *p, mpc_input_t *i) {
+  if (p->first_known != 1 || p->nullable) { return 1; }
+  if (mpc_input_terminated(i)) { return 0; }
+  return mpc_first_has(p, mpc_input_peekc(i)) != 0;
 }
 
 /*
-** This is rather pleasant. The core parsing routine
-** is written in about 200 lines of C.
-**
-** I also love the way in which each parsing type
-** concisely matches some construct or pattern.
-**
-** Particularly nice are the `or` and `and`
-** types which have a broken but mirrored structure
-** with return value and error reflected.
-**
-** When this function was written in recursive form
-** it looked pretty nice. But I've since switched
-** it around to an awkward while loop. It was an
-** unfortunate change for code simplicity but it
-** is noble in the name of performance (and 
-** not smashing the stack).
+** Stack Type
 **
-** But it is now a pretty ugly beast...
+** The stacks only ever grow. Once a run is over its
+** stack goes back to the input it ran on, and the
+** next run on that input (the full run after a fast
+** one, or a lexer match) picks it up again, so most
+** steps of the parse loop just store into space
+** that is already there.
 */
 
-#define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
-#define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
-#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
-#define MPC_PRIMITIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input")); }
+typedef struct mpc_stack_t {
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+  int parsers_num;
+  int parsers_slots;
+  mpc_parser_t **parsers;
+  int *states;
+
+  int results_num;
+  int results_slots;
+  mpc_result_t *results;
+  int *returns;
   
-  /* Stack */
-  int st = 0;
-  mpc_parser_t *p = NULL;
-  mpc_stack_t *stk = mpc_stack_new(i->filename);
+  mpc_err_t *err;
   
-  /* Variables */
-  char *s;
-  mpc_result_t r;
-
-  /* Go! */
-  mpc_stack_pushp(stk, init);
+  int span_root;
+  long span_pos;
   
-  while (!mpc_stack_empty(stk)) {
-    
-    mpc_stack_peepp(stk, &p, &st);
-    
-    switch (p->type) {
-      
-      /* Basic Parsers */
+  int memo_num;
+  int memo_slots;
+  struct mpc_memo_frame_t *memo_frames;
+  struct mpc_memo_t *memo;
+  
+  int prune;
+  int quiet;
+  
+  int expr_num;
+  int expr_slots;
+  int *expr_ops;
+  
+  struct mpc_stack_t *next;
+  
+} mpc_stack_t;
 
-      case MPC_TYPE_ANY:       MPC_PRIMITIVE(s, mpc_input_any(i, &s));
-      case MPC_TYPE_SINGLE:    MPC_PRIMITIVE(s, mpc_input_char(i, p->data.single.x, &s));
-      case MPC_TYPE_RANGE:     MPC_PRIMITIVE(s, mpc_input_range(i, p->data.range.x, p->data.range.y, &s));
-      case MPC_TYPE_ONEOF:     MPC_PRIMITIVE(s, mpc_input_oneof(i, p->data.string.x, &s));
-      case MPC_TYPE_NONEOF:    MPC_PRIMITIVE(s, mpc_input_noneof(i, p->data.string.x, &s));
-      case MPC_TYPE_SATISFY:   MPC_PRIMITIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, &s));
-      case MPC_TYPE_STRING:    MPC_PRIMITIVE(s, mpc_input_string(i, p->data.string.x, &s));
-      
-      /* Other parsers */
-      
-      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Parser Undefined!"));      
-      case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i->filename, i->state, p->data.fail.m));
-      case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-      case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-      case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_state_copy(i->state));
-      
-      case MPC_TYPE_ANCHOR:
-        if (mpc_input_anchor(i, p->data.anchor.f)) {
-          MPC_SUCCESS(NULL);
-        } else {
-          MPC_FAILURE(mpc_err_new(i->filename, i->state, "anchor", mpc_input_peekc(i)));
-        }
+static mpc_stack_t *mpc_stack_new(mpc_input_t *i, int fast) {
+  mpc_stack_t *s = i->stacks;
+  
+  if (s) {
+    i->stacks = s->next;
+  } else {
+    s = malloc(sizeof(mpc_stack_t));
+    s->parsers_slots = 0;
+    s->parsers = NULL;
+    s->states = NULL;
+    s->results_slots = 0;
+    s->results = NULL;
+    s->returns = NULL;
+    s->memo_slots = 0;
+    s->memo_frames = NULL;
+    s->memo = NULL;
+    s->expr_slots = 0;
+    s->expr_ops = NULL;
+  }
+  
+  s->parsers_num = 0;
+  s->results_num = 0;
+  
+  s->err = fast ? NULL : mpc_err_fail(i->filename, mpc_state_invalid(), "Unknown Error");
+  
+  s->span_root = -1;
+  s->span_pos = 0;
+  
+  s->memo_num = 0;
+  
+  s->prune = fast;
+  s->quiet = fast;
+  
+  s->expr_num = 0;
+  s->next = NULL;
+  
+  return s;
+}
+
+static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
+  mpc_err_t *errs[2];
+  if (s->quiet) { return; }
+  errs[0] = s->err;
+  errs[1] = e;
+  s->err = mpc_err_or(errs, 2);
+}
+
+static void mpc_stack_memo_clear(mpc_stack_t *s);
+
+static int mpc_stack_terminate(mpc_stack_t *s, mpc_input_t *i, mpc_result_t *r) {
+  int success = s->returns[0];
+  
+  if (success) {
+    r->output = s->results[0].output;
+    mpc_err_delete(s->err);
+  } else {
+    mpc_stack_err(s, s->results[0].error);
+    r->error = s->err;
+  }
+  
+  mpc_stack_memo_clear(s);
+  s->next = i->stacks;
+  i->stacks = s;
+  
+  return success;
+}
+
+static void mpc_stack_delete(mpc_stack_t *s) {
+  mpc_stack_t *n;
+  while (s) {
+    n = s->next;
+    free(s->memo);
+    free(s->memo_frames);
+    free(s->expr_ops);
+    free(s->parsers);
+    free(s->states);
+    free(s->results);
+    free(s->returns);
+    free(s);
+    s = n;
+  }
+}
+
+/* Stack Parser Stuff */
+
+static void mpc_stack_set_state(mpc_stack_t *s, int x) {
+  s->states[s->parsers_num-1] = x;
+}
+
+static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
+  s->parsers_slots = s->parsers_slots ? s->parsers_slots * 2 : 64;
+  s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
+  s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
+}
+
+static void mpc_stack_pushp(mpc_stack_t *s, mpc_parser_t *p) {
+  if (s->parsers_num == s->parsers_slots) { mpc_stack_parsers_reserve_more(s); }
+  s->parsers_num++;
+  s->parsers[s->parsers_num-1] = p;
+  s->states[s->parsers_num-1] = 0;
+}
+
+static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
+  *p = s->parsers[s->parsers_num-1];
+  *st = s->states[s->parsers_num-1];
+  s->parsers_num--;
+}
+
+static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
+  *p = s->parsers[s->parsers_num-1];
+  *st = s->states[s->parsers_num-1];
+}
+
+static int mpc_stack_empty(mpc_stack_t *s) {
+  return s->parsers_num == 0;
+}
+
+/* Stack Result Stuff */
+
+static mpc_result_t mpc_result_err(mpc_err_t *e) {
+  mpc_result_t r;
+  r.error = e;
+  return r;
+}
+
+static mpc_result_t mpc_result_out(mpc_val_t *x) {
+  mpc_result_t r;
+  r.output = x;
+  return r;
+}
+
+static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
+  s->results_slots = s->results_slots ? s->results_slots * 2 : 64;
+  s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
+  s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
+}
+
+static void mpc_stack_pushr(mpc_stack_t *s, mpc_result_t x, int r) {
+  if (s->results_num == s->results_slots) { mpc_stack_results_reserve_more(s); }
+  s->results_num++;
+  s->results[s->results_num-1] = x;
+  s->returns[s->results_num-1] = r;
+}
+
+static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
+  int r;
+  *x = s->results[s->results_num-1];
+  r = s->returns[s->results_num-1];
+  s->results_num--;
+  return r;
+}
+
+static int mpc_stack_peekr(mpc_stack_t *s, mpc_result_t *x) {
+  *x = s->results[s->results_num-1];
+  return s->returns[s->results_num-1];
+}
+
+static void mpc_stack_popr_err(mpc_stack_t *s, int n) {
+  mpc_result_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    mpc_stack_err(s, x.error);
+    n--;
+  }
+}
+
+/* Results in an arena are not freed one by one */
+
+static void mpc_dtor_call(mpc_dtor_t d, mpc_val_t *x) {
+  if (mpc_arena_current && d == free) { return; }
+  d(x);
+}
+
+static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
+  mpc_result_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    mpc_dtor_call(ds[n-1], x.output);
+    n--;
+  }
+}
+
+static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_dtor_t dx) {
+  mpc_result_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    mpc_dtor_call(dx, x.output);
+    n--;
+  }
+}
+
+static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
+  mpc_result_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    n--;
+  }
+}
+
+static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
+  mpc_val_t *x = s->span_root >= 0 ? NULL : f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
+  mpc_stack_popr_n(s, n);
+  return x;
+}
+
+/* Span Stuff */
+
+static int mpc_stack_spanning(mpc_stack_t *s) {
+  return s->span_root >= 0;
+}
+
+static void mpc_stack_span_begin(mpc_stack_t *s, mpc_input_t *i, mpc_parser_t *p) {
+  if (s->span_root >= 0 || !p->span || i->type != MPC_INPUT_STRING) { return; }
+  s->span_root = s->parsers_num-1;
+  s->span_pos = i->state.pos;
+}
+
+static mpc_val_t *mpc_stack_span_end(mpc_stack_t *s, mpc_input_t *i, mpc_val_t *x) {
+  
+  char *o;
+  long n;
+  
+  if (s->span_root != s->parsers_num) { return x; }
+  
+  s->span_root = -1;
+  n = i->state.pos - s->span_pos;
+  o = mpc_malloc(n + 1);
+  memcpy(o, i->string + s->span_pos, n);
+  o[n] = '\0';
+  return o;
+}
+
+static void mpc_stack_span_fail(mpc_stack_t *s) {
+  if (s->span_root == s->parsers_num) { s->span_root = -1; }
+}
+
+/*
+** Memo Stuff
+**
+** Rules marked with `memo` remember their result at
+** each input position in a direct mapped table. When
+** an alternative backtracks and tries the same rule
+** at the same position again, a copy of the earlier
+** output or error is returned and the input skips
+** straight to where that parse ended. A collision
+** evicts the older entry so the table stays bounded.
+**
+** Outputs larger than `MPC_MEMO_NODES` are not kept,
+** as copying them on every success costs more than
+** the rare retry saves. Their smaller parts may still
+** be in the table, but evictions and unkept outputs
+** mean this is not the linear time packrat parser of
+** the literature, only a cache that cuts most retries.
+*/
+
+#define MPC_MEMO_SLOTS 1024
+#define MPC_MEMO_NODES 32
+
+typedef struct mpc_memo_t {
+  mpc_parser_t *p;
+  long pos;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_result_t r;
+} mpc_memo_t;
+
+typedef struct mpc_memo_frame_t {
+  mpc_parser_t *p;
+  int depth;
+  long pos;
+} mpc_memo_frame_t;
+
+static int mpc_stack_memoizing(mpc_stack_t *s, mpc_input_t *i, mpc_parser_t *p) {
+  return p->memo && !p->span && !mpc_stack_spanning(s) && i->type == MPC_INPUT_STRING;
+}
+
+static mpc_memo_t *mpc_stack_memo_slot(mpc_stack_t *s, mpc_parser_t *p, long pos) {
+  unsigned long h = ((unsigned long)p >> 4) * 31 + (unsigned long)pos;
+  return &s->memo[h % MPC_MEMO_SLOTS];
+}
+
+static void mpc_memo_clear(mpc_memo_t *m) {
+  if (m->p == NULL) { return; }
+  if (m->success) { mpc_ast_delete(m->r.output); }
+  else { mpc_err_delete(m->r.error); }
+  m->p = NULL;
+}
+
+static mpc_memo_t *mpc_stack_memo_find(mpc_stack_t *s, mpc_input_t *i, mpc_parser_t *p) {
+  
+  mpc_memo_t *m;
+  
+  if (s->memo == NULL) { return NULL; }
+  m = mpc_stack_memo_slot(s, p, i->state.pos);
+  if (m->p != p || m->pos != i->state.pos) { return NULL; }
+  
+  i->state = m->state;
+  i->last = m->last;
+  return m;
+}
+
+static void mpc_stack_memo_begin(mpc_stack_t *s, mpc_input_t *i, mpc_parser_t *p) {
+  
+  if (s->memo == NULL) { s->memo = calloc(MPC_MEMO_SLOTS, sizeof(mpc_memo_t)); }
+  
+  if (s->memo_num == s->memo_slots) {
+    s->memo_slots = s->memo_slots ? s->memo_slots * 2 : 16;
+    s->memo_frames = realloc(s->memo_frames, sizeof(mpc_memo_frame_t) * s->memo_slots);
+  }
+  
+  s->memo_frames[s->memo_num].p = p;
+  s->memo_frames[s->memo_num].depth = s->parsers_num;
+  s->memo_frames[s->memo_num].pos = i->state.pos;
+  s->memo_num++;
+}
+
+/* Called once the parser on top has been popped */
+static mpc_memo_frame_t *mpc_stack_memo_end(mpc_stack_t *s) {
+  
+  mpc_memo_frame_t *f;
+  
+  if (s->memo_num == 0) { return NULL; }
+  f = &s->memo_frames[s->memo_num-1];
+  if (f->depth != s->parsers_num+1) { return NULL; }
+  s->memo_num--;
+  
+  /* Nothing can ask for the outermost parser again */
+  return s->parsers_num > 0 ? f : NULL;
+}
+
+static void mpc_stack_memo_store(mpc_stack_t *s, mpc_input_t *i, mpc_memo_frame_t *f, int success, mpc_result_t r) {
+  mpc_memo_t *m = mpc_stack_memo_slot(s, f->p, f->pos);
+  mpc_memo_clear(m);
+  m->p = f->p;
+  m->pos = f->pos;
+  m->success = success;
+  m->state = i->state;
+  m->last = i->last;
+  m->r = r;
+}
+
+static int mpc_memo_small(mpc_ast_t *a, int *n) {
+  int j;
+  if (a == NULL) { return 1; }
+  if (++(*n) > MPC_MEMO_NODES) { return 0; }
+  for (j = 0; j < a->children_num; j++) {
+    if (!mpc_memo_small(a->children[j], n)) { return 0; }
+  }
+  return 1;
+}
+
+static mpc_val_t *mpc_stack_memo_out(mpc_stack_t *s, mpc_input_t *i, mpc_val_t *x) {
+  int n = 0;
+  mpc_memo_frame_t *f = mpc_stack_memo_end(s);
+  if (f && mpc_memo_small(x, &n)) {
+    mpc_stack_memo_store(s, i, f, 1, mpc_result_out(mpc_ast_copy(x)));
+  }
+  return x;
+}
+
+static mpc_err_t *mpc_stack_memo_err(mpc_stack_t *s, mpc_input_t *i, mpc_err_t *x) {
+  mpc_memo_frame_t *f = mpc_stack_memo_end(s);
+  if (f) { mpc_stack_memo_store(s, i, f, 0, mpc_result_err(mpc_err_copy(x))); }
+  return x;
+}
+
+static void mpc_stack_memo_clear(mpc_stack_t *s) {
+  int j;
+  if (s->memo) {
+    for (j = 0; j < MPC_MEMO_SLOTS; j++) { mpc_memo_clear(&s->memo[j]); }
+  }
+}
+
+/* Or Stuff */
+
+static int mpc_stack_or_next(mpc_stack_t *s, mpc_input_t *i, mpc_parser_t *p, int k) {
+  if (!s->prune) { return k; }
+  while (k < p->data.or.n && !mpc_first_viable(p->data.or.xs[k], i)) { k++; }
+  return k;
+}
+
+static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
+  mpc_err_t *x = s->quiet ? NULL : mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
+  mpc_stack_popr_n(s, n);
+  return x;
+}
+
+/*
+** Expression Stuff
+**
+** Operands and operators of an expression are pushed
+** onto the result stack as they are parsed, and which
+** operator each one is goes on a stack of its own. An
+** operator first folds the operators before it that
+** bind at least as tightly, so at the end whatever is
+** left can be folded from the right.
+*/
+
+static int mpc_stack_expr_next(mpc_stack_t *s, mpc_input_t *i, mpc_parser_t *p, int k) {
+  if (!s->prune) { return k; }
+  while (k < p->data.expr.n && !mpc_first_viable(p->data.expr.ops[k], i)) { k++; }
+  return k;
+}
+
+static void mpc_stack_expr_push(mpc_stack_t *s, int k) {
+  if (s->expr_num == s->expr_slots) {
+    s->expr_slots = s->expr_slots ? s->expr_slots * 2 : 8;
+    s->expr_ops = realloc(s->expr_ops, sizeof(int) * s->expr_slots);
+  }
+  s->expr_ops[s->expr_num++] = k;
+}
+
+/* Folds the `t` waiting operators down to those binding less tightly than `k` */
+static int mpc_stack_expr_reduce(mpc_stack_t *s, mpc_parser_t *p, int t, int k) {
+  
+  mpc_op_t *ops = p->data.expr.table;
+  int j;
+  
+  while (t > 0) {
+    j = s->expr_ops[s->expr_num-1];
+    if (k >= 0 && ops[j].prec < ops[k].prec) { break; }
+    if (k >= 0 && ops[j].prec == ops[k].prec && ops[k].assoc == MPC_ASSOC_RIGHT) { break; }
+    mpc_stack_pushr(s, mpc_result_out(mpc_stack_merger_out(s, 3, ops[j].f)), 1);
+    s->expr_num--;
+    t--;
+  }
+  
+  return t;
+}
+
+/*
+** This is rather pleasant. The core parsing routine
+** is written in about 200 lines of C.
+**
+** I also love the way in which each parsing type
+** concisely matches some construct or pattern.
+**
+** Particularly nice are the `or` and `and`
+** types which have a broken but mirrored structure
+** with return value and error reflected.
+**
+** When this function was written in recursive form
+** it looked pretty nice. But I've since switched
+** it around to an awkward while loop. It was an
+** unfortunate change for code simplicity but it
+** is noble in the name of performance (and 
+** not smashing the stack).
+**
+** But it is now a pretty ugly beast...
+*/
+
+#define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
+#define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(mpc_stack_memo_out(stk, i, mpc_stack_span_end(stk, i, x))), 1); continue
+#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_span_fail(stk); mpc_stack_pushr(stk, mpc_result_err(mpc_stack_memo_err(stk, i, x)), 0); continue
+#define MPC_PRIMITIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(MPC_ERROR(mpc_err_fail(i->filename, i->state, "Incorrect Input"))); }
+#define MPC_ERROR(x) (stk->quiet ? NULL : (x))
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final, int fast) {
+  
+  /* Stack */
+  int st = 0;
+  mpc_parser_t *p = NULL;
+  mpc_stack_t *stk = mpc_stack_new(i, fast);
+  
+  /* Variables */
+  int k, t;
+  char *s, **so;
+  mpc_result_t r;
+  mpc_memo_t *m;
+  mpc_token_t *tok;
+  mpc_err_t *e;
+
+  /* Go! */
+  i->cut = 0;
+  i->cut_failed = 0;
+  mpc_stack_pushp(stk, init);
+  
+  while (!mpc_stack_empty(stk)) {
+    
+    mpc_stack_peepp(stk, &p, &st);
+    
+    /* Backtracking past a cut fails everything still to run */
+    if (st == 0 && i->cut_failed) {
+      MPC_FAILURE(MPC_ERROR(mpc_err_fail(i->filename, mpc_state_invalid(), "Unknown Error")));
+    }
+    
+    if (st == 0 && mpc_stack_memoizing(stk, i, p)) {
+      m = mpc_stack_memo_find(stk, i, p);
+      if (m && m->success) { MPC_SUCCESS(mpc_ast_copy(m->r.output)); }
+      if (m) { MPC_FAILURE(MPC_ERROR(mpc_err_copy(m->r.error))); }
+      mpc_stack_memo_begin(stk, i, p);
+    }
+    
+    if (st == 0) { mpc_stack_span_begin(stk, i, p); }
+    
+    /* Inside a span primitives need not build output */
+    s = NULL;
+    so = mpc_stack_spanning(stk) ? NULL : &s;
+    
+    switch (p->type) {
+      
+      /* Basic Parsers */
+
+      case MPC_TYPE_ANY:       MPC_PRIMITIVE(s, mpc_input_any(i, so));
+      case MPC_TYPE_SINGLE:    MPC_PRIMITIVE(s, mpc_input_char(i, p->data.single.x, so));
+      case MPC_TYPE_RANGE:
+      case MPC_TYPE_ONEOF:
+      case MPC_TYPE_NONEOF:    MPC_PRIMITIVE(s, mpc_input_charset(i, p->data.charset.s, so));
+      case MPC_TYPE_SATISFY:   MPC_PRIMITIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, so));
+      case MPC_TYPE_STRING:    MPC_PRIMITIVE(s, mpc_input_string(i, p->data.string.x, so));
+      
+      /* Full parses run the original regex to get the same errors */
+      case MPC_TYPE_DFA:
+        if (st == 0 && stk->quiet) { MPC_PRIMITIVE(s, mpc_input_dfa(i, p->data.dfa.d, so)); }
+        if (st == 0) { MPC_CONTINUE(1, p->data.dfa.x); }
+        if (mpc_stack_popr(stk, &r)) {
+          MPC_SUCCESS(r.output);
+        } else {
+          MPC_FAILURE(r.error);
+        }
+      
+      case MPC_TYPE_RUN:
+        if (st == 0 && stk->quiet) { mpc_input_run(i, p->data.run.r, so); MPC_SUCCESS(s); }
+        if (st == 0) { MPC_CONTINUE(1, p->data.run.x); }
+        if (mpc_stack_popr(stk, &r)) {
+          MPC_SUCCESS(r.output);
+        } else {
+          MPC_FAILURE(r.error);
+        }
+      
+      /* Terminals which the token table says are not here fail. The
+         original terminal still runs so a real mismatch reports the same
+         errors, but its inner errors are set aside for the duration. */
+      case MPC_TYPE_TOKEN:
+        if (st == 0 && i->type != MPC_INPUT_STRING) { MPC_CONTINUE(1, p->data.token.x); }
+        if (st == 0) {
+          tok = mpc_input_token(i, p->data.token.l);
+          if (tok->id == p->data.token.id+1 && stk->quiet) {
+            mpc_input_advance(i, i->state.pos + tok->len, so);
+            if (p->data.token.blank) { mpc_input_run(i, &p->data.token.l->blank, NULL); }
+            MPC_SUCCESS(s);
+          }
+          if (tok->id == p->data.token.id+1) { MPC_CONTINUE(1, p->data.token.x); }
+          if (stk->quiet) { MPC_FAILURE(NULL); }
+          mpc_input_mark(i);
+          mpc_stack_pushr(stk, mpc_result_err(stk->err), 0);
+          stk->err = mpc_err_fail(i->filename, mpc_state_invalid(), "Unknown Error");
+          MPC_CONTINUE(2, p->data.token.x);
+        }
+        if (st == 1) {
+          if (mpc_stack_popr(stk, &r)) {
+            MPC_SUCCESS(r.output);
+          } else {
+            MPC_FAILURE(r.error);
+          }
+        }
+        /* Only the mismatch check of state 2 is left */
+        if (mpc_stack_popr(stk, &r)) {
+          mpc_free(r.output);
+          mpc_input_rewind(i);
+          mpc_stack_popr(stk, &r);
+          mpc_err_delete(stk->err);
+          stk->err = r.error;
+          MPC_FAILURE(mpc_err_token(i, p->data.token.m, mpc_input_token(i, p->data.token.l)));
+        } else {
+          mpc_input_unmark(i);
+          e = r.error;
+          mpc_stack_popr(stk, &r);
+          mpc_stack_pushr(stk, mpc_result_err(stk->err), 0);
+          stk->err = r.error;
+          mpc_stack_popr_err(stk, 1);
+          MPC_FAILURE(e);
+        }
+      
+      /* Expression Parsers */
+      
+      /* The state holds how many operators are waiting and which one is running */
+      case MPC_TYPE_EXPR:
+        
+        if (st == 0) { MPC_CONTINUE(1, p->data.expr.x); }
+        
+        t = (st-1) / (p->data.expr.n+1);
+        k = (st-1) % (p->data.expr.n+1) - 1;
+        
+        if (k < 0 && !mpc_stack_popr(stk, &r)) {
+          if (t == 0) { MPC_FAILURE(r.error); }
+          
+          /* No operand after the last operator so give it back */
+          mpc_stack_err(stk, r.error);
+          mpc_input_rewind(i);
+          mpc_stack_popr(stk, &r);
+          mpc_dtor_call(p->data.expr.dop, r.output);
+          stk->expr_num--;
+          mpc_stack_expr_reduce(stk, p, t-1, -1);
+          mpc_stack_popr(stk, &r);
+          MPC_SUCCESS(r.output);
+        }
+        
+        if (k < 0) {
+          if (t > 0) { mpc_input_unmark(i); }
+          mpc_stack_pushr(stk, r, 1);
+        } else if (mpc_stack_popr(stk, &r)) {
+          t = mpc_stack_expr_reduce(stk, p, t, k);
+          mpc_stack_pushr(stk, r, 1);
+          mpc_stack_expr_push(stk, k);
+          MPC_CONTINUE(1 + (t+1) * (p->data.expr.n+1), p->data.expr.x);
+        } else {
+          mpc_stack_err(stk, r.error);
+          mpc_input_rewind(i);
+        }
+        
+        k = mpc_stack_expr_next(stk, i, p, k+1);
+        if (k < p->data.expr.n) {
+          mpc_input_mark(i);
+          MPC_CONTINUE(1 + t * (p->data.expr.n+1) + k+1, p->data.expr.ops[k]);
+        }
+        
+        mpc_stack_expr_reduce(stk, p, t, -1);
+        mpc_stack_popr(stk, &r);
+        MPC_SUCCESS(r.output);
+      
+      /* Other parsers */
+      
+      case MPC_TYPE_UNDEFINED: MPC_FAILURE(MPC_ERROR(mpc_err_fail(i->filename, i->state, "Parser Undefined!")));      
+      case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+      
+      /* Errors from before the cut can no longer be reported */
+      case MPC_TYPE_CUT:
+        mpc_input_cut(i);
+        if (!stk->quiet) {
+          mpc_err_delete(stk->err);
+          stk->err = mpc_err_fail(i->filename, mpc_state_invalid(), "Unknown Error");
+        }
+        MPC_SUCCESS(NULL);
+      case MPC_TYPE_FAIL:      MPC_FAILURE(MPC_ERROR(mpc_err_fail(i->filename, i->state, p->data.fail.m)));
+      case MPC_TYPE_LIFT:      MPC_SUCCESS(mpc_stack_spanning(stk) ? NULL : p->data.lift.lf());
+      case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+      case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_state_copy(i->state));
+      
+      case MPC_TYPE_ANCHOR:
+        if (mpc_input_anchor(i, p->data.anchor.f)) {
+          MPC_SUCCESS(NULL);
+        } else {
+          MPC_FAILURE(MPC_ERROR(mpc_err_new(i->filename, i->state, "anchor", mpc_input_peekc(i))));
+        }
       
       /* Application Parsers */
       
@@ -1016,7 +2501,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             MPC_SUCCESS(r.output);
           } else {
             mpc_err_delete(r.error); 
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, p->data.expect.m, mpc_input_peekc(i)));
+            MPC_FAILURE(MPC_ERROR(mpc_err_new(i->filename, i->state, p->data.expect.m, mpc_input_peekc(i))));
           }
         }
       
@@ -1057,12 +2542,12 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
             mpc_input_rewind(i);
-            p->data.not.dx(r.output);
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, "opposite", mpc_input_peekc(i)));
+            mpc_dtor_call(p->data.not.dx, r.output);
+            MPC_FAILURE(MPC_ERROR(mpc_err_new(i->filename, i->state, "opposite", mpc_input_peekc(i))));
           } else {
             mpc_input_unmark(i);
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(p->data.not.lf());
+            MPC_SUCCESS(mpc_stack_spanning(stk) ? NULL : p->data.not.lf());
           }
         }
       
@@ -1073,7 +2558,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             MPC_SUCCESS(r.output);
           } else {
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(p->data.not.lf());
+            MPC_SUCCESS(mpc_stack_spanning(stk) ? NULL : p->data.not.lf());
           }
         }
       
@@ -1099,7 +2584,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           } else {
             if (st == 1) {
               mpc_stack_popr(stk, &r);
-              MPC_FAILURE(mpc_err_many1(r.error));
+              MPC_FAILURE(MPC_ERROR(mpc_err_many1(r.error)));
             } else {
               mpc_stack_popr(stk, &r);
               mpc_stack_err(stk, r.error);
@@ -1118,7 +2603,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
               mpc_stack_popr(stk, &r);
               mpc_stack_popr_out_single(stk, st-1, p->data.repeat.dx);
               mpc_input_rewind(i);
-              MPC_FAILURE(mpc_err_count(r.error, p->data.repeat.n));
+              MPC_FAILURE(MPC_ERROR(mpc_err_count(r.error, p->data.repeat.n)));
             } else {
               mpc_stack_popr(stk, &r);
               mpc_stack_err(stk, r.error);
@@ -1134,16 +2619,24 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         
         if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
         
-        if (st == 0) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
-        if (st <= p->data.or.n) {
-          if (mpc_stack_peekr(stk, &r)) {
-            mpc_stack_popr(stk, &r);
-            mpc_stack_popr_err(stk, st-1);
-            MPC_SUCCESS(r.output);
-          }
-          if (st <  p->data.or.n) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
-          if (st == p->data.or.n) { MPC_FAILURE(mpc_stack_merger_err(stk, p->data.or.n)); }
+        if (st == 0) {
+          k = mpc_stack_or_next(stk, i, p, 0);
+          if (k <  p->data.or.n) { MPC_CONTINUE(k+1, p->data.or.xs[k]); }
+          if (k == p->data.or.n) { MPC_FAILURE(MPC_ERROR(mpc_err_fail(i->filename, i->state, "Unexpected Input"))); }
         }
+        
+        /* The state holds the running alternative and how many failed before it */
+        k = (st-1) % (p->data.or.n+1);
+        t = (st-1) / (p->data.or.n+1);
+        if (mpc_stack_peekr(stk, &r)) {
+          mpc_stack_popr(stk, &r);
+          mpc_stack_popr_err(stk, t);
+          MPC_SUCCESS(r.output);
+        }
+        t++;
+        k = mpc_stack_or_next(stk, i, p, k+1);
+        if (k <  p->data.or.n) { MPC_CONTINUE(k+1 + (p->data.or.n+1) * t, p->data.or.xs[k]); }
+        if (k == p->data.or.n) { MPC_FAILURE(mpc_stack_merger_err(stk, t)); }
       
       case MPC_TYPE_AND:
         
@@ -1165,11 +2658,11 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       
       default:
         
-        MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Unknown Parser Type Id!"));
+        MPC_FAILURE(MPC_ERROR(mpc_err_fail(i->filename, i->state, "Unknown Parser Type Id!")));
     }
   }
   
-  return mpc_stack_terminate(stk, final);
+  return mpc_stack_terminate(stk, i, final);
   
 }
 
@@ -1177,6 +2670,30 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
+#undef MPC_ERROR
+
+/*
+** Inputs held in memory are first parsed in a fast
+** mode, which skips `or` alternatives that cannot
+** match and never builds an error. Errors are only
+** wanted when the whole parse fails, so then the
+** input is rewound and parsed again in full to get
+** the message.
+*/
+
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+  
+  mpc_state_t state = i->state;
+  char last = i->last;
+  
+  if (i->type == MPC_INPUT_STRING) {
+    if (mpc_parse_run(i, init, final, 1)) { return 1; }
+    i->state = state;
+    i->last = last;
+  }
+  
+  return mpc_parse_run(i, init, final, 0);
+}
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
   int x;
@@ -1186,6 +2703,75 @@ int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_res
   return x;
 }
 
+int mpc_parse_borrowed(const char *filename, const char *ptr, long len, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_borrowed(filename, ptr, len);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_arena(const char *filename, const char *ptr, long len, mpc_arena_t *a, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_arena_t *prev = mpc_arena_current;
+  mpc_input_t *i = mpc_input_new_borrowed(filename, ptr, len);
+  mpc_arena_current = a;
+  x = mpc_parse_input(i, p, r);
+  mpc_arena_current = prev;
+  mpc_input_delete(i);
+  return x;
+}
+
+/*
+** A context keeps the stacks and marks of one parse
+** for the next, so a thread parsing many inputs with
+** it only allocates them once.
+*/
+
+struct mpc_context_t {
+  mpc_stack_t *stacks;
+  int marks_slots;
+  mpc_state_t *marks;
+  char *lasts;
+};
+
+mpc_context_t *mpc_context_new(void) {
+  return calloc(1, sizeof(mpc_context_t));
+}
+
+void mpc_context_delete(mpc_context_t *c) {
+  mpc_stack_delete(c->stacks);
+  free(c->marks);
+  free(c->lasts);
+  free(c);
+}
+
+int mpc_parse_context(const char *filename, const char *ptr, long len, mpc_context_t *c, mpc_arena_t *a, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_arena_t *prev = mpc_arena_current;
+  mpc_input_t *i = mpc_input_new_borrowed(filename, ptr, len);
+  
+  i->stacks = c->stacks;
+  i->marks_slots = c->marks_slots;
+  i->marks = c->marks;
+  i->lasts = c->lasts;
+  
+  mpc_arena_current = a;
+  x = mpc_parse_input(i, p, r);
+  mpc_arena_current = prev;
+  
+  c->stacks = i->stacks;
+  c->marks_slots = i->marks_slots;
+  c->marks = i->marks;
+  c->lasts = i->lasts;
+  i->stacks = NULL;
+  i->marks = NULL;
+  i->lasts = NULL;
+  
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_file(filename, file);
@@ -1223,6 +2809,7 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 */
 
 static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+static void mpc_dfa_release(mpc_dfa_t *d);
 
 static void mpc_undefine_or(mpc_parser_t *p) {
   
@@ -1245,6 +2832,18 @@ static void mpc_undefine_and(mpc_parser_t *p) {
   
 }
 
+static void mpc_undefine_expr(mpc_parser_t *p) {
+  
+  int i;
+  mpc_undefine_unretained(p->data.expr.x, 0);
+  for (i = 0; i < p->data.expr.n; i++) {
+    mpc_undefine_unretained(p->data.expr.ops[i], 0);
+  }
+  free(p->data.expr.ops);
+  free(p->data.expr.table);
+  
+}
+
 static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
   
   if (p->retained && !force) { return; }
@@ -1253,8 +2852,12 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     
     case MPC_TYPE_FAIL: free(p->data.fail.m); break;
     
+    case MPC_TYPE_RANGE:
     case MPC_TYPE_ONEOF: 
     case MPC_TYPE_NONEOF:
+      free(p->data.charset.x); 
+      break;
+    
     case MPC_TYPE_STRING:
       free(p->data.string.x); 
       break;
@@ -1279,8 +2882,25 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
       mpc_undefine_unretained(p->data.repeat.x, 0);
       break;
     
-    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
-    case MPC_TYPE_AND: mpc_undefine_and(p); break;
+    case MPC_TYPE_OR:   mpc_undefine_or(p);   break;
+    case MPC_TYPE_AND:  mpc_undefine_and(p);  break;
+    case MPC_TYPE_EXPR: mpc_undefine_expr(p); break;
+    
+    case MPC_TYPE_DFA:
+      mpc_dfa_release(p->data.dfa.d);
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      break;
+    
+    case MPC_TYPE_RUN:
+      free(p->data.run.r);
+      mpc_undefine_unretained(p->data.run.x, 0);
+      break;
+    
+    case MPC_TYPE_TOKEN:
+      mpc_lexer_release(p->data.token.l);
+      mpc_undefine_unretained(p->data.token.x, 0);
+      free(p->data.token.m);
+      break;
     
     default: break;
   }
@@ -1330,6 +2950,9 @@ mpc_parser_t *mpc_new(const char *name) {
 mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
   mpc_undefine_unretained(p, 1);
   p->type = MPC_TYPE_UNDEFINED;
+  p->span = 0;
+  p->memo = 0;
+  p->first_known = 0;
   return p;
 }
 
@@ -1338,6 +2961,8 @@ mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   if (p->retained) {
     p->type = a->type;
     p->data = a->data;
+    p->span = a->span;
+    p->first_known = 0;
   } else {
     mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
     p->type = a2->type;
@@ -1369,6 +2994,12 @@ mpc_parser_t *mpc_pass(void) {
   return p;
 }
 
+mpc_parser_t *mpc_cut(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_CUT;
+  return p;
+}
+
 mpc_parser_t *mpc_fail(const char *m) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_FAIL;
@@ -1427,6 +3058,7 @@ mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_LIFT;
   p->data.lift.lf = lf;
+  mpc_span_check(p);
   return p;
 }
 
@@ -1449,6 +3081,7 @@ mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
   p->data.expect.x = a;
   p->data.expect.m = malloc(strlen(expected) + 1);
   strcpy(p->data.expect.m, expected);
+  mpc_span_check(p);
   return p;
 }
 
@@ -1487,6 +3120,7 @@ mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
   buffer = realloc(buffer, strlen(buffer) + 1);
   p->data.expect.x = a;
   p->data.expect.m = buffer;
+  mpc_span_check(p);
   return p;
 }
 
@@ -1497,6 +3131,7 @@ mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
 mpc_parser_t *mpc_any(void) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_ANY;
+  mpc_span_check(p);
   return mpc_expect(p, "any character");
 }
 
@@ -1504,38 +3139,71 @@ mpc_parser_t *mpc_char(char c) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_SINGLE;
   p->data.single.x = c;
+  mpc_span_check(p);
   return mpc_expectf(p, "'%c'", c);
 }
 
+/*
+** Ranges and character classes are stored as a
+** 256 bit set so that matching is a single lookup.
+** The class string is kept only for printing. As
+** strchr finds the terminator, a oneof class has
+** always matched '\0' and a noneof class never has.
+*/
+
+static void mpc_charset_add(unsigned char *set, char c) {
+  set[(unsigned char)c >> 3] |= 1 << ((unsigned char)c & 7);
+}
+
+static mpc_parser_t *mpc_charset(int type, const char *s) {
+  
+  int c;
+  mpc_parser_t *p = mpc_undefined();
+  p->type = type;
+  p->data.charset.x = malloc(strlen(s) + 1);
+  strcpy(p->data.charset.x, s);
+  memset(p->data.charset.s, 0, sizeof(p->data.charset.s));
+  
+  mpc_charset_add(p->data.charset.s, '\0');
+  while (*s) { mpc_charset_add(p->data.charset.s, *s++); }
+  
+  if (type == MPC_TYPE_NONEOF) {
+    for (c = 0; c < 32; c++) { p->data.charset.s[c] = ~p->data.charset.s[c]; }
+  }
+  
+  mpc_span_check(p);
+  return p;
+}
+
 mpc_parser_t *mpc_range(char s, char e) {
+  int c;
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_RANGE;
-  p->data.range.x = s;
-  p->data.range.y = e;
+  p->data.charset.x = malloc(3);
+  p->data.charset.x[0] = s;
+  p->data.charset.x[1] = e;
+  p->data.charset.x[2] = '\0';
+  memset(p->data.charset.s, 0, sizeof(p->data.charset.s));
+  for (c = 0; c < 256; c++) {
+    if ((char)c >= s && (char)c <= e) { mpc_charset_add(p->data.charset.s, (char)c); }
+  }
+  mpc_span_check(p);
   return mpc_expectf(p, "character between '%c' and '%c'", s, e);
 }
 
 mpc_parser_t *mpc_oneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "one of '%s'", s);
+  return mpc_expectf(mpc_charset(MPC_TYPE_ONEOF, s), "one of '%s'", s);
 }
 
 mpc_parser_t *mpc_noneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "one of '%s'", s);
-
+  return mpc_expectf(mpc_charset(MPC_TYPE_NONEOF, s), "one of '%s'", s);
 }
 
 mpc_parser_t *mpc_satisfy(int(*f)(char)) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_SATISFY;
   p->data.satisfy.f = f;
+  mpc_span_check(p);
   return mpc_expectf(p, "character satisfying function %p", f);
 }
 
@@ -1544,6 +3212,7 @@ mpc_parser_t *mpc_string(const char *s) {
   p->type = MPC_TYPE_STRING;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
+  mpc_span_check(p);
   return mpc_expectf(p, "\"%s\"", s);
 }
 
@@ -1581,6 +3250,7 @@ mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   p->data.not.x = a;
   p->data.not.dx = da;
   p->data.not.lf = lf;
+  mpc_span_check(p);
   return p;
 }
 
@@ -1593,6 +3263,7 @@ mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
   p->type = MPC_TYPE_MAYBE;
   p->data.not.x = a;
   p->data.not.lf = lf;
+  mpc_span_check(p);
   return p;
 }
 
@@ -1605,6 +3276,7 @@ mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
   p->type = MPC_TYPE_MANY;
   p->data.repeat.x = a;
   p->data.repeat.f = f;
+  mpc_span_check(p);
   return p;
 }
 
@@ -1613,6 +3285,7 @@ mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
   p->type = MPC_TYPE_MANY1;
   p->data.repeat.x = a;
   p->data.repeat.f = f;
+  mpc_span_check(p);
   return p;
 }
 
@@ -1623,6 +3296,7 @@ mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
   p->data.repeat.f = f;
   p->data.repeat.x = a;
   p->data.repeat.dx = da;
+  mpc_span_check(p);
   return p;
 }
 
@@ -1643,6 +3317,7 @@ mpc_parser_t *mpc_or(int n, ...) {
   }
   va_end(va);
   
+  mpc_span_check(p);
   return p;
 }
 
@@ -1668,7 +3343,46 @@ mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
   }  
   va_end(va);
   
-  return p;
+  mpc_span_check(p);
+  return p;
+}
+
+/*
+** An expression parser reads operands from `a` with
+** the operators in `ops` between them, folding them
+** by precedence as it goes rather than through one
+** rule per level. Operators are tried in table order.
+*/
+
+static mpc_parser_t *mpc_expr_new(mpc_parser_t *a, int n, mpc_parser_t **xs, const mpc_op_t *ops, mpc_dtor_t dop) {
+  
+  mpc_parser_t *p = mpc_undefined();
+  
+  p->type = MPC_TYPE_EXPR;
+  p->data.expr.n = n;
+  p->data.expr.x = a;
+  p->data.expr.ops = xs;
+  p->data.expr.table = malloc(sizeof(mpc_op_t) * n);
+  p->data.expr.dop = dop;
+  memcpy(p->data.expr.table, ops, sizeof(mpc_op_t) * n);
+  
+  mpc_span_check(p);
+  return p;
+}
+
+mpc_parser_t *mpc_expr(mpc_parser_t *a, const mpc_op_t *ops) {
+  
+  int i, n = 0;
+  mpc_parser_t **xs;
+  
+  while (ops[n].op) { n++; }
+  
+  xs = malloc(sizeof(mpc_parser_t*) * n);
+  for (i = 0; i < n; i++) {
+    xs[i] = mpc_sym(ops[i].op);
+  }
+  
+  return mpc_expr_new(a, n, xs, ops, free);
 }
 
 /*
@@ -1694,9 +3408,34 @@ static int mpc_boundary_anchor(char prev, char next) {
 
 mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "boundary"); }
 
+/*
+** A run parser matches the same input as `x` but
+** scans it in one go. Full parses, which report the
+** errors, still run `x` so the messages are the same.
+** String inputs hold no '\0' so it is left out.
+*/
+
+static mpc_parser_t *mpc_run(const char *s, mpc_parser_t *x, int drop) {
+  
+  mpc_run_t *r = malloc(sizeof(mpc_run_t));
+  mpc_parser_t *p = mpc_undefined();
+  
+  mpc_run_init(r, s);
+  r->drop = drop;
+  
+  p->type = MPC_TYPE_RUN;
+  p->data.run.r = r;
+  p->data.run.x = x;
+  mpc_span_check(p);
+  return p;
+}
+
+mpc_parser_t *mpc_class_run(const char *s) { return mpc_run(s, mpc_many(mpcf_strfold, mpc_oneof(s)), 0); }
+
 mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
-mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
-mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
+mpc_parser_t *mpc_whitespaces(void) { return mpc_run(" \f\n\r\t\v", mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"), 0); }
+mpc_parser_t *mpc_blank_run(void) { return mpc_run(" \f\n\r\t\v", mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"), 1); }
+mpc_parser_t *mpc_blank(void) { return mpc_blank_run(); }
 
 mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
 mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
@@ -2005,6 +3744,201 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
+/*
+** A regex built only from character classes, each
+** taken once, optionally, zero or more or one or more
+** times, or a fixed number of times, matches like a
+** DFA. Every repeat is greedy and never gives back
+** what it took, so at each step the next character
+** decides alone whether to take it, move on to the
+** next part or stop. A fixed count must also not be
+** followed by one more of the class.
+*/
+
+#define MPC_DFA_PARTS 64
+
+enum {
+  MPC_DFA_ONE,
+  MPC_DFA_MAYBE,
+  MPC_DFA_MANY,
+  MPC_DFA_NONE
+};
+
+typedef struct {
+  int n;
+  int kinds[MPC_DFA_PARTS];
+  unsigned char sets[MPC_DFA_PARTS][32];
+} mpc_dfa_parts_t;
+
+static mpc_dfa_t *mpc_dfa_cache = NULL;
+static mpc_lock_t mpc_dfa_lock = MPC_LOCK_INIT;
+
+static int mpc_dfa_class(mpc_parser_t *p, unsigned char *set) {
+  
+  int j;
+  
+  switch (p->type) {
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      memset(p->first, 0, sizeof(p->first));
+      mpc_first_chars(p);
+      for (j = 0; j < 32; j++) { set[j] |= p->first[j]; }
+      return 1;
+    
+    case MPC_TYPE_EXPECT:
+      return mpc_dfa_class(p->data.expect.x, set);
+    
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_dfa_class(p->data.or.xs[j], set)) { return 0; }
+      }
+      return p->data.or.n > 0;
+    
+    default: return 0;
+  }
+}
+
+static int mpc_dfa_part(mpc_dfa_parts_t *ps, int kind, mpc_parser_t *x) {
+  if (ps->n == MPC_DFA_PARTS) { return 0; }
+  memset(ps->sets[ps->n], 0, 32);
+  ps->kinds[ps->n] = kind;
+  return mpc_dfa_class(x, ps->sets[ps->n++]);
+}
+
+static int mpc_dfa_parts(mpc_dfa_parts_t *ps, mpc_parser_t *p) {
+  
+  int j;
+  
+  if (p->retained) { return 0; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_LIFT: return p->data.lift.lf == mpcf_ctor_str;
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return 0; }
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_dfa_parts(ps, p->data.and.xs[j])) { return 0; }
+      }
+      return 1;
+    
+    case MPC_TYPE_MAYBE:
+      return p->data.not.lf == mpcf_ctor_str
+        && mpc_dfa_part(ps, MPC_DFA_MAYBE, p->data.not.x);
+    
+    case MPC_TYPE_MANY:
+      return p->data.repeat.f == mpcf_strfold
+        && mpc_dfa_part(ps, MPC_DFA_MANY, p->data.repeat.x);
+    
+    case MPC_TYPE_MANY1:
+      return p->data.repeat.f == mpcf_strfold
+        && mpc_dfa_part(ps, MPC_DFA_ONE, p->data.repeat.x)
+        && mpc_dfa_part(ps, MPC_DFA_MANY, p->data.repeat.x);
+    
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      for (j = 0; j < p->data.repeat.n; j++) {
+        if (!mpc_dfa_part(ps, MPC_DFA_ONE, p->data.repeat.x)) { return 0; }
+      }
+      return mpc_dfa_part(ps, MPC_DFA_NONE, p->data.repeat.x);
+    
+    default:
+      return mpc_dfa_part(ps, MPC_DFA_ONE, p);
+  }
+}
+
+static mpc_dfa_t *mpc_dfa_compile(const char *re, mpc_parser_t *p) {
+  
+  int s, t, c;
+  mpc_dfa_t *d;
+  mpc_dfa_parts_t ps;
+  
+  ps.n = 0;
+  if (!mpc_dfa_parts(&ps, p)) { return NULL; }
+  
+  /* One state per part plus a final one where the match stops */
+  d = malloc(sizeof(mpc_dfa_t));
+  d->re = malloc(strlen(re) + 1);
+  strcpy(d->re, re);
+  d->refs = 1;
+  d->states = ps.n + 1;
+  d->trans = malloc(sizeof(short) * 256 * d->states);
+  d->eof = malloc(d->states);
+  
+  for (s = 0; s < d->states; s++) {
+    
+    for (c = 0; c < 256; c++) {
+      for (t = s; t < ps.n; t++) {
+        if (ps.sets[t][c >> 3] & (1 << (c & 7))) {
+          if (ps.kinds[t] == MPC_DFA_NONE) { t = -1; }
+          break;
+        }
+        if (ps.kinds[t] == MPC_DFA_ONE) { t = -1; break; }
+      }
+      if (t < 0)          { d->trans[s * 256 + c] = MPC_DFA_FAIL; }
+      else if (t == ps.n) { d->trans[s * 256 + c] = MPC_DFA_STOP; }
+      else                { d->trans[s * 256 + c] = ps.kinds[t] == MPC_DFA_MANY ? t : t+1; }
+    }
+    
+    d->eof[s] = 1;
+    for (t = s; t < ps.n; t++) {
+      if (ps.kinds[t] == MPC_DFA_ONE) { d->eof[s] = 0; }
+    }
+  }
+  
+  d->next = mpc_dfa_cache;
+  mpc_dfa_cache = d;
+  return d;
+}
+
+static void mpc_dfa_release(mpc_dfa_t *d) {
+  
+  mpc_dfa_t **e;
+  
+  mpc_lock(&mpc_dfa_lock);
+  
+  if (--d->refs > 0) { mpc_unlock(&mpc_dfa_lock); return; }
+  
+  for (e = &mpc_dfa_cache; *e; e = &(*e)->next) {
+    if (*e == d) { *e = d->next; break; }
+  }
+  
+  mpc_unlock(&mpc_dfa_lock);
+  
+  free(d->re);
+  free(d->trans);
+  free(d->eof);
+  free(d);
+}
+
+static mpc_parser_t *mpc_re_dfa(const char *re, mpc_parser_t *x) {
+  
+  mpc_parser_t *p;
+  mpc_dfa_t *d;
+  
+  mpc_lock(&mpc_dfa_lock);
+  
+  for (d = mpc_dfa_cache; d; d = d->next) {
+    if (strcmp(d->re, re) == 0) { d->refs++; break; }
+  }
+  
+  if (d == NULL) { d = mpc_dfa_compile(re, x); }
+  
+  mpc_unlock(&mpc_dfa_lock);
+  
+  if (d == NULL) { return x; }
+  
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.d = d;
+  p->data.dfa.x = x;
+  mpc_span_check(p);
+  return p;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   
   char *err_msg;
@@ -2060,7 +3994,7 @@ mpc_parser_t *mpc_re(const char *re) {
   mpc_delete(RegexEnclose);
   mpc_cleanup(5, Regex, Term, Factor, Base, Range);
   
-  return r.output;
+  return mpc_re_dfa(re, r.output);
   
 }
 
@@ -2071,34 +4005,34 @@ mpc_parser_t *mpc_re(const char *re) {
 void mpcf_dtor_null(mpc_val_t *x) { (void) x; return; }
 
 mpc_val_t *mpcf_ctor_null(void) { return NULL; }
-mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
-mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+mpc_val_t *mpcf_ctor_str(void) { return mpc_calloc(1, 1); }
+mpc_val_t *mpcf_free(mpc_val_t *x) { mpc_free(x); return NULL; }
 
 mpc_val_t *mpcf_int(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
+  int *y = mpc_malloc(sizeof(int));
   *y = strtol(x, NULL, 10);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_hex(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
+  int *y = mpc_malloc(sizeof(int));
   *y = strtol(x, NULL, 16);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_oct(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
+  int *y = mpc_malloc(sizeof(int));
   *y = strtol(x, NULL, 8);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_float(mpc_val_t *x) {
-  float* y = malloc(sizeof(float));
+  float* y = mpc_malloc(sizeof(float));
   *y = strtod(x, NULL);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
@@ -2124,7 +4058,7 @@ static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **
   int i;
   int found;
   char *s = x;
-  char *y = calloc(1, 1);
+  char *y = mpc_calloc(1, 1);
   char buff[2];
   
   while (*s) {
@@ -2134,7 +4068,7 @@ static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **
 
     while (output[i]) {
       if (*s == input[i]) {
-        y = realloc(y, strlen(y) + strlen(output[i]) + 1);
+        y = mpc_realloc(y, strlen(y) + strlen(output[i]) + 1);
         strcat(y, output[i]);
         found = 1;
         break;
@@ -2143,7 +4077,7 @@ static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **
     }
     
     if (!found) {
-      y = realloc(y, strlen(y) + 2);
+      y = mpc_realloc(y, strlen(y) + 2);
       buff[0] = *s; buff[1] = '\0';
       strcat(y, buff);
     }
@@ -2160,7 +4094,7 @@ static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char
   int i;
   int found = 0;
   char *s = x;
-  char *y = calloc(1, 1);
+  char *y = mpc_calloc(1, 1);
   char buff[2];
 
   while (*s) {
@@ -2171,7 +4105,7 @@ static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char
     while (output[i]) {
       if ((*(s+0)) == output[i][0] &&
           (*(s+1)) == output[i][1]) {
-        y = realloc(y, strlen(y) + 2);
+        y = mpc_realloc(y, strlen(y) + 2);
         buff[0] = input[i]; buff[1] = '\0';
         strcat(y, buff);
         found = 1;
@@ -2182,7 +4116,7 @@ static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char
     }
       
     if (!found) {
-      y = realloc(y, strlen(y) + 2);
+      y = mpc_realloc(y, strlen(y) + 2);
       buff[0] = *s; buff[1] = '\0';
       strcat(y, buff);
     }
@@ -2197,49 +4131,49 @@ static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char
 
 mpc_val_t *mpcf_escape(mpc_val_t *x) {
   mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_unescape(mpc_val_t *x) {
   mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_escape_regex(mpc_val_t *x) {
   mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-  free(x);
+  mpc_free(x);
   return y;  
 }
 
 mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
   mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-  free(x);
+  mpc_free(x);
   return y;  
 }
 
 mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
   mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
   mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
   mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
   mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
@@ -2251,7 +4185,7 @@ mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { (void) n; return xs[2]; }
 static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
   int i;
   for (i = 0; i < n; i++) {
-    if (i != x) { free(xs[i]); }
+    if (i != x) { mpc_free(xs[i]); }
   }
   return xs[x];
 }
@@ -2261,12 +4195,12 @@ mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1)
 mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
-  char *x = calloc(1, 1);
+  char *x = mpc_calloc(1, 1);
   int i;
   for (i = 0; i < n; i++) {
-    x = realloc(x, strlen(x) + strlen(xs[i]) + 1);
+    x = mpc_realloc(x, strlen(x) + strlen(xs[i]) + 1);
     strcat(x, xs[i]);
-    free(xs[i]);
+    mpc_free(xs[i]);
   }
   return x;
 }
@@ -2281,7 +4215,7 @@ mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
   if (strcmp(xs[1], "+") == 0) { *vs[0] += *vs[2]; }
   if (strcmp(xs[1], "-") == 0) { *vs[0] -= *vs[2]; }
   
-  free(xs[1]); free(xs[2]);
+  mpc_free(xs[1]); mpc_free(xs[2]);
   
   return xs[0];
 }
@@ -2306,6 +4240,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   
   if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
   if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
+  if (p->type == MPC_TYPE_CUT)    { printf("^"); }
   if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
   if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
   if (p->type == MPC_TYPE_STATE)  { printf("<S>"); }
@@ -2329,12 +4264,12 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   }
   
   if (p->type == MPC_TYPE_RANGE) {
-    buff[0] = p->data.range.x; buff[1] = '\0';
+    buff[0] = p->data.charset.x[0]; buff[1] = '\0';
     s = mpcf_escape_new(
       buff,
       mpc_escape_input_c,
       mpc_escape_output_c);
-    buff[0] = p->data.range.y; buff[1] = '\0';
+    buff[0] = p->data.charset.x[1]; buff[1] = '\0';
     e = mpcf_escape_new(
       buff,
       mpc_escape_input_c,
@@ -2346,7 +4281,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   
   if (p->type == MPC_TYPE_ONEOF) {
     s = mpcf_escape_new(
-      p->data.string.x,
+      p->data.charset.x,
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("[%s]", s);
@@ -2355,7 +4290,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   
   if (p->type == MPC_TYPE_NONEOF) {
     s = mpcf_escape_new(
-      p->data.string.x,
+      p->data.charset.x,
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("[^%s]", s);
@@ -2371,6 +4306,9 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     free(s);
   }
   
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_RUN)      { mpc_print_unretained(p->data.run.x, 0); }
+  if (p->type == MPC_TYPE_TOKEN)    { mpc_print_unretained(p->data.token.x, 0); }
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
@@ -2402,6 +4340,16 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     printf(")");
   }
   
+  if (p->type == MPC_TYPE_EXPR) {
+    printf("(");
+    mpc_print_unretained(p->data.expr.x, 0);
+    for(i = 0; i < p->data.expr.n; i++) {
+      printf(" %s ", p->data.expr.table[i].assoc == MPC_ASSOC_RIGHT ? "%right" : "%left");
+      mpc_print_unretained(p->data.expr.ops[i], 0);
+    }
+    printf(")");
+  }
+  
 }
 
 void mpc_print(mpc_parser_t *p) {
@@ -2479,38 +4427,191 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
+/*
+** AST tags are interned. Every distinct tag string
+** exists once and nodes only point to it, so tagging a
+** node never allocates and two tags are equal exactly
+** when the pointers are. Tags live until the program
+** ends or `mpc_intern_cleanup` frees the whole table.
+**
+** The table is shared by all threads and guarded by a
+** lock, but a parse only ever makes the few tags of its
+** grammar. So each thread keeps a small cache of the
+** tags it has interned, and once it has seen them all
+** its parses no longer take the lock. A cleanup bumps
+** the generation, which tells every thread to forget
+** what it cached before.
+**
+** Prepending a rule name to a tag goes through a small
+** cache of (name, tag) pairs as the same few pairs come
+** up over and over in a parse.
+*/
+
+typedef struct {
+  int num;
+  int slots;
+  char **strs;
+} mpc_intern_t;
+
+typedef struct {
+  const char *t;
+  const char *tag;
+  char *result;
+} mpc_intern_pair_t;
+
+enum { MPC_INTERN_PAIRS = 1021, MPC_INTERN_CACHE = 509 };
+
+static mpc_intern_t mpc_intern_table = { 0, 0, NULL };
+static mpc_lock_t mpc_intern_lock = MPC_LOCK_INIT;
+static int mpc_intern_generation = 0;
+static MPC_THREAD_LOCAL mpc_intern_pair_t mpc_intern_pairs[MPC_INTERN_PAIRS];
+static MPC_THREAD_LOCAL char *mpc_intern_cache[MPC_INTERN_CACHE];
+static MPC_THREAD_LOCAL int mpc_intern_cached = 0;
+
+static void mpc_intern_cache_check(void) {
+  if (mpc_intern_cached == mpc_intern_generation) { return; }
+  memset(mpc_intern_pairs, 0, sizeof(mpc_intern_pairs));
+  memset(mpc_intern_cache, 0, sizeof(mpc_intern_cache));
+  mpc_intern_cached = mpc_intern_generation;
+}
+
+static unsigned long mpc_intern_hash(const char *s) {
+  unsigned long h = 5381;
+  while (*s) { h = h * 33 + (unsigned char)*s++; }
+  return h;
+}
+
+static void mpc_intern_grow(void) {
+  
+  int i, j, slots = mpc_intern_table.slots ? mpc_intern_table.slots * 2 : 256;
+  char **strs = calloc(slots, sizeof(char*));
+  
+  for (i = 0; i < mpc_intern_table.slots; i++) {
+    if (mpc_intern_table.strs[i] == NULL) { continue; }
+    j = mpc_intern_hash(mpc_intern_table.strs[i]) % slots;
+    while (strs[j]) { j = (j + 1) % slots; }
+    strs[j] = mpc_intern_table.strs[i];
+  }
+  
+  free(mpc_intern_table.strs);
+  mpc_intern_table.strs = strs;
+  mpc_intern_table.slots = slots;
+}
+
+const char *mpc_intern(const char *s) {
+  
+  int i;
+  char *r;
+  unsigned long h = mpc_intern_hash(s);
+  char **c = &mpc_intern_cache[h % MPC_INTERN_CACHE];
+  
+  mpc_intern_cache_check();
+  if (*c && strcmp(*c, s) == 0) { return *c; }
+  
+  mpc_lock(&mpc_intern_lock);
+  
+  if ((mpc_intern_table.num + 1) * 4 > mpc_intern_table.slots * 3) { mpc_intern_grow(); }
+  
+  i = h % mpc_intern_table.slots;
+  while (mpc_intern_table.strs[i]) {
+    if (strcmp(mpc_intern_table.strs[i], s) == 0) { break; }
+    i = (i + 1) % mpc_intern_table.slots;
+  }
+  
+  if (mpc_intern_table.strs[i] == NULL) {
+    mpc_intern_table.strs[i] = malloc(strlen(s) + 1);
+    strcpy(mpc_intern_table.strs[i], s);
+    mpc_intern_table.num++;
+  }
+  
+  r = mpc_intern_table.strs[i];
+  mpc_unlock(&mpc_intern_lock);
+  *c = r;
+  return r;
+}
+
+void mpc_intern_cleanup(void) {
+  
+  int i;
+  
+  mpc_lock(&mpc_intern_lock);
+  
+  for (i = 0; i < mpc_intern_table.slots; i++) {
+    free(mpc_intern_table.strs[i]);
+  }
+  
+  free(mpc_intern_table.strs);
+  mpc_intern_table.num = 0;
+  mpc_intern_table.slots = 0;
+  mpc_intern_table.strs = NULL;
+  mpc_intern_generation++;
+  
+  mpc_unlock(&mpc_intern_lock);
+}
+
+static char *mpc_intern_pair(const char *t, const char *tag) {
+  
+  mpc_intern_pair_t *e = &mpc_intern_pairs[((unsigned long)t ^ ((unsigned long)tag >> 4)) % MPC_INTERN_PAIRS];
+  char *buffer;
+  
+  mpc_intern_cache_check();
+  if (e->t == t && e->tag == tag) { return e->result; }
+  
+  buffer = malloc(strlen(t) + 1 + strlen(tag) + 1);
+  strcpy(buffer, t);
+  strcat(buffer, "|");
+  strcat(buffer, tag);
+  
+  e->t = t;
+  e->tag = tag;
+  e->result = (char*)mpc_intern(buffer);
+  free(buffer);
+  return e->result;
+}
+
+/*
+** Nodes without contents share a single empty string
+*/
+
+static char mpc_ast_no_contents[1] = { '\0' };
+
+static void mpc_ast_free_contents(mpc_ast_t *a) {
+  if (a->contents != mpc_ast_no_contents) { mpc_free(a->contents); }
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
   
   int i;
   
-  if (a == NULL) { return; }
+  if (a == NULL || mpc_arena_current) { return; }
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
   }
   
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+  mpc_free(a->children);
+  mpc_ast_free_contents(a);
+  mpc_free(a);
   
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+  mpc_free(a->children);
+  mpc_ast_free_contents(a);
+  mpc_free(a);
 }
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+/* Takes ownership of `contents` rather than copying it */
+static mpc_ast_t *mpc_ast_new_adopt(const char *tag, char *contents) {
   
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  mpc_ast_t *a = mpc_malloc(sizeof(mpc_ast_t));
   
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  a->tag = (char*)mpc_intern(tag);
   
-  a->contents = malloc(strlen(contents) + 1);
-  strcpy(a->contents, contents);
+  if (contents != mpc_ast_no_contents && contents[0] == '\0') {
+    mpc_free(contents);
+    contents = mpc_ast_no_contents;
+  }
+  a->contents = contents;
   
   a->state = mpc_state_new();
   
@@ -2520,6 +4621,46 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
 }
 
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+  
+  char *c = mpc_ast_no_contents;
+  
+  if (contents[0] != '\0') {
+    c = mpc_malloc(strlen(contents) + 1);
+    strcpy(c, contents);
+  }
+  
+  return mpc_ast_new_adopt(tag, c);
+}
+
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *c;
+  
+  if (a == NULL) { return NULL; }
+  
+  c = mpc_malloc(sizeof(mpc_ast_t));
+  c->tag = a->tag;
+  c->contents = mpc_ast_no_contents;
+  if (a->contents[0] != '\0') {
+    c->contents = mpc_malloc(strlen(a->contents) + 1);
+    strcpy(c->contents, a->contents);
+  }
+  c->state = a->state;
+  
+  c->children_num = a->children_num;
+  c->children = NULL;
+  if (a->children_num) {
+    c->children = mpc_malloc(sizeof(mpc_ast_t*) * a->children_num);
+    for (i = 0; i < a->children_num; i++) {
+      c->children[i] = mpc_ast_copy(a->children[i]);
+    }
+  }
+  
+  return c;
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
   
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -2555,7 +4696,7 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   
   int i;
 
-  if (strcmp(a->tag, b->tag) != 0) { return 0; }
+  if (a->tag != b->tag && strcmp(a->tag, b->tag) != 0) { return 0; }
   if (strcmp(a->contents, b->contents) != 0) { return 0; }
   if (a->children_num != b->children_num) { return 0; }
   
@@ -2568,23 +4709,32 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
   r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
+  r->children = mpc_realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
   return r;
 }
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
+  a->tag = mpc_intern_pair(mpc_intern(t), a->tag);
   return a;
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
+  a->tag = (char*)mpc_intern(t);
+  return a;
+}
+
+/* As above for tags which are already interned */
+
+static mpc_ast_t *mpc_ast_add_tag_interned(mpc_ast_t *a, const char *t) {
+  if (a == NULL) { return a; }
+  a->tag = mpc_intern_pair(t, a->tag);
+  return a;
+}
+
+static mpc_ast_t *mpc_ast_tag_interned(mpc_ast_t *a, const char *t) {
+  a->tag = (char*)t;
   return a;
 }
 
@@ -2618,8 +4768,162 @@ void mpc_ast_print(mpc_ast_t *a) {
   mpc_ast_print_depth(a, 0, stdout);
 }
 
-void mpc_ast_print_to(mpc_ast_t *a, FILE *fp) {
-  mpc_ast_print_depth(a, 0, fp);
+void mpc_ast_print_to(mpc_ast_t *a, FILE *fp) {
+  mpc_ast_print_depth(a, 0, fp);
+}
+
+/*
+** Flattened AST
+**
+** A whole tree packed into one block: a header, the nodes in
+** pre-order, a table of tag offsets and a pool holding every tag
+** and contents string. All links are indices or offsets into the
+** block, so it can be copied with memcpy or written out as is.
+*/
+
+typedef struct {
+  unsigned long nodes;
+  unsigned long strings;
+  unsigned long tags_num;
+  unsigned long tags_max;
+  const char **tags;
+} mpc_flat_count_t;
+
+static unsigned int mpc_flat_find_tag(const char **tags, unsigned long n, const char *tag) {
+  unsigned long i;
+  for (i = 0; i < n; i++) {
+    if (tags[i] == tag || strcmp(tags[i], tag) == 0) { return (unsigned int)i; }
+  }
+  return MPC_FLAT_NONE;
+}
+
+static void mpc_flat_count(mpc_flat_count_t *c, mpc_ast_t *a) {
+  
+  int i;
+  
+  c->nodes++;
+  c->strings += strlen(a->contents) + 1;
+  
+  if (mpc_flat_find_tag(c->tags, c->tags_num, a->tag) == MPC_FLAT_NONE) {
+    if (c->tags_num == c->tags_max) {
+      c->tags_max = c->tags_max ? c->tags_max * 2 : 16;
+      c->tags = realloc(c->tags, sizeof(const char*) * c->tags_max);
+    }
+    c->tags[c->tags_num++] = a->tag;
+    c->strings += strlen(a->tag) + 1;
+  }
+  
+  for (i = 0; i < a->children_num; i++) {
+    mpc_flat_count(c, a->children[i]);
+  }
+}
+
+static unsigned int mpc_flat_fill(mpc_flat_t *f, mpc_flat_count_t *c,
+  mpc_ast_t *a, unsigned int parent, unsigned long *n, unsigned long *s) {
+  
+  int i;
+  unsigned int x, prev = MPC_FLAT_NONE;
+  unsigned int idx = (unsigned int)(*n)++;
+  mpc_flat_node_t *node = mpc_flat_node(f, idx);
+  char *pool = (char*)f + f->strings;
+  unsigned long len = strlen(a->contents);
+  
+  node->tag = mpc_flat_find_tag(c->tags, c->tags_num, a->tag);
+  node->parent = parent;
+  node->next = MPC_FLAT_NONE;
+  node->children_num = (unsigned int)a->children_num;
+  node->contents = (unsigned int)*s;
+  node->length = (unsigned int)len;
+  node->state = a->state;
+  memcpy(pool + *s, a->contents, len + 1);
+  *s += len + 1;
+  
+  for (i = 0; i < a->children_num; i++) {
+    x = mpc_flat_fill(f, c, a->children[i], idx, n, s);
+    if (prev != MPC_FLAT_NONE) { mpc_flat_node(f, prev)->next = x; }
+    prev = x;
+  }
+  
+  return idx;
+}
+
+mpc_flat_t *mpc_ast_flatten(mpc_ast_t *a) {
+  
+  unsigned long i, n = 0, s = 0, len;
+  unsigned int *tags;
+  char *pool;
+  mpc_flat_t *f;
+  mpc_flat_count_t c;
+  
+  c.nodes = 0; c.strings = 0;
+  c.tags_num = 0; c.tags_max = 0; c.tags = NULL;
+  mpc_flat_count(&c, a);
+  
+  f = malloc(sizeof(mpc_flat_t)
+    + sizeof(mpc_flat_node_t) * c.nodes
+    + sizeof(unsigned int) * c.tags_num
+    + c.strings);
+  f->nodes_num = c.nodes;
+  f->tags_num = c.tags_num;
+  f->strings = sizeof(mpc_flat_t)
+    + sizeof(mpc_flat_node_t) * c.nodes
+    + sizeof(unsigned int) * c.tags_num;
+  f->size = f->strings + c.strings;
+  
+  tags = (unsigned int*)((char*)f + sizeof(mpc_flat_t) + sizeof(mpc_flat_node_t) * c.nodes);
+  pool = (char*)f + f->strings;
+  
+  for (i = 0; i < c.tags_num; i++) {
+    len = strlen(c.tags[i]);
+    tags[i] = (unsigned int)s;
+    memcpy(pool + s, c.tags[i], len + 1);
+    s += len + 1;
+  }
+  
+  mpc_flat_fill(f, &c, a, MPC_FLAT_NONE, &n, &s);
+  
+  free(c.tags);
+  return f;
+}
+
+mpc_flat_t *mpc_flat_copy(const mpc_flat_t *f) {
+  mpc_flat_t *g = malloc(f->size);
+  memcpy(g, f, f->size);
+  return g;
+}
+
+void mpc_flat_delete(mpc_flat_t *f) {
+  free(f);
+}
+
+mpc_flat_node_t *mpc_flat_node(const mpc_flat_t *f, unsigned int i) {
+  return (mpc_flat_node_t*)((char*)f + sizeof(mpc_flat_t)) + i;
+}
+
+unsigned int mpc_flat_child(const mpc_flat_t *f, unsigned int i) {
+  return mpc_flat_node(f, i)->children_num ? i + 1 : MPC_FLAT_NONE;
+}
+
+unsigned int mpc_flat_next(const mpc_flat_t *f, unsigned int i) {
+  return mpc_flat_node(f, i)->next;
+}
+
+const char *mpc_flat_tag(const mpc_flat_t *f, unsigned int i) {
+  const unsigned int *tags = (const unsigned int*)mpc_flat_node(f, (unsigned int)f->nodes_num);
+  return (const char*)f + f->strings + tags[mpc_flat_node(f, i)->tag];
+}
+
+const char *mpc_flat_contents(const mpc_flat_t *f, unsigned int i) {
+  return (const char*)f + f->strings + mpc_flat_node(f, i)->contents;
+}
+
+unsigned int mpc_flat_tag_id(const mpc_flat_t *f, const char *tag) {
+  unsigned long i;
+  const unsigned int *tags = (const unsigned int*)mpc_flat_node(f, (unsigned int)f->nodes_num);
+  for (i = 0; i < f->tags_num; i++) {
+    if (strcmp((const char*)f + f->strings + tags[i], tag) == 0) { return (unsigned int)i; }
+  }
+  return MPC_FLAT_NONE;
 }
 
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
@@ -2661,16 +4965,14 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
 }
 
 mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
-  free(c);
-  return a;
+  return mpc_ast_new_adopt("", c);
 }
 
 mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
   mpc_state_t *s = ((mpc_state_t**)xs)[0];
   mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
   a = mpc_ast_state(a, *s);
-  free(s);
+  mpc_free(s);
   (void) n;
   return a;
 }
@@ -2680,11 +4982,11 @@ mpc_parser_t *mpca_state(mpc_parser_t *a) {
 }
 
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag_interned, (void*)mpc_intern(t));
 }
 
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag_interned, (void*)mpc_intern(t));
 }
 
 mpc_parser_t *mpca_root(mpc_parser_t *a) {
@@ -2774,7 +5076,9 @@ mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_
 **
 **      <grammar> : (<term> "|" <grammar>) | <term>
 **     
-**      <term> : <factor>*
+**      <term> : <factor>* <level>*
+**
+**      <level> : ("%left" | "%right") (<string_lit> | <char_lit>)+
 **
 **      <factor> : <base>
 **               | <base> "*"
@@ -2786,6 +5090,7 @@ mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_
 **             | <string_lit>
 **             | <char_lit>
 **             | <regex_lit>
+**             | "^"
 **             | "(" <grammar> ")"
 */
 
@@ -2794,6 +5099,7 @@ typedef struct {
   int parsers_num;
   mpc_parser_t **parsers;
   int flags;
+  mpc_lexer_t *lexer;
 } mpca_grammar_st_t;
 
 static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
@@ -2824,30 +5130,249 @@ static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) {
   return mpca_count(num, xs[0]);
 }
 
+/*
+** With `MPCA_LANG_LEXER` each terminal is added to the
+** grammar's lexer, once per distinct pattern, and is
+** wrapped so that it only matches where the lexer finds
+** its token. Terminals that may match nothing, such as
+** anchors, are left to match characters as before.
+*/
+
+static mpc_parser_t *mpca_token(mpca_grammar_st_t *st, mpc_parser_t *x, const char *text, int literal, const char *m) {
+  
+  int t;
+  mpc_lexer_t *l;
+  mpc_parser_t *re = NULL, *p;
+  
+  if (!(st->flags & MPCA_LANG_LEXER) || text[0] == '\0') { return x; }
+  
+  if (st->lexer == NULL) { st->lexer = mpc_lexer_new(); }
+  l = st->lexer;
+  
+  for (t = 0; t < l->num; t++) {
+    if (l->literal[t] == literal && strcmp(l->texts[t], text) == 0) { break; }
+  }
+  
+  if (t == l->num) {
+    
+    if (!literal) {
+      re = mpc_re(text);
+      mpc_first_compute(1, &re);
+      if (re->nullable) { mpc_delete(re); return x; }
+    }
+    
+    l->num++;
+    l->texts = realloc(l->texts, sizeof(char*) * l->num);
+    l->literal = realloc(l->literal, sizeof(char) * l->num);
+    l->res = realloc(l->res, sizeof(mpc_parser_t*) * l->num);
+    l->texts[t] = malloc(strlen(text) + 1);
+    strcpy(l->texts[t], text);
+    l->literal[t] = literal;
+    l->res[t] = re;
+  }
+  
+  l->refs++;
+  p = mpc_undefined();
+  p->type = MPC_TYPE_TOKEN;
+  p->data.token.l = l;
+  p->data.token.id = t;
+  p->data.token.blank = !(st->flags & MPCA_LANG_WHITESPACE_SENSITIVE);
+  p->data.token.x = x;
+  p->data.token.m = malloc(strlen(m) + 1);
+  strcpy(p->data.token.m, m);
+  mpc_span_check(p);
+  return p;
+}
+
+/*
+** With `MPCA_LANG_COLLAPSE` brackets and separators
+** give no node, as the shape of the tree says all they
+** did, and a rule whose result is left with one child
+** gives that child, which keeps the rule's tag.
+*/
+
+static int mpca_delimiter(const char *y) {
+  return y[0] != '\0' && y[strspn(y, "()[]{},;")] == '\0';
+}
+
+static mpc_val_t *mpcaf_collapse(mpc_val_t *x) {
+  mpc_ast_t *a = x, *c;
+  if (a == NULL || a->children_num != 1 || strcmp(a->tag, ">") != 0) { return a; }
+  c = a->children[0];
+  mpc_ast_delete_no_children(a);
+  return c;
+}
+
+static mpc_parser_t *mpca_literal(mpca_grammar_st_t *st, mpc_parser_t *p, const char *y, const char *tag) {
+  if ((st->flags & MPCA_LANG_COLLAPSE) && mpca_delimiter(y)) { return mpc_apply(p, mpcf_free); }
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), tag));
+}
+
 static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
   mpca_grammar_st_t *st = s;
   char *y = mpcf_unescape(x);
+  char *m = malloc(strlen(y) + 3);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
+  sprintf(m, "\"%s\"", y);
+  p = mpca_literal(st, mpca_token(st, p, y, 1, m), y, "string");
+  free(m);
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+  return p;
 }
 
 static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
   mpca_grammar_st_t *st = s;
   char *y = mpcf_unescape(x);
+  char m[4] = {'\'', '\0', '\'', '\0'};
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
+  m[1] = y[0];
+  y[1] = '\0';
+  p = mpca_literal(st, mpca_token(st, p, y, 1, m), y, "char");
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+  return p;
+}
+
+/* Regexes with no special characters match only themselves */
+static int mpca_regex_literal(const char *y) {
+  return y[strcspn(y, "\\^$.|?*+()[]{}")] == '\0';
 }
 
 static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
   mpca_grammar_st_t *st = s;
   char *y = mpcf_unescape_regex(x);
+  char *m = malloc(strlen(y) + 3);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re(y) : mpc_tok(mpc_re(y));
+  sprintf(m, "/%s/", y);
+  p = mpca_token(st, p, y, mpca_regex_literal(y), m);
+  free(m);
   free(y);
   return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
 }
 
+/*
+** Operator levels after a term make it an expression
+** of such terms. Each level binds tighter than those
+** before it, and the node for each operator is tagged
+** `binop` holding the two operands either side of it.
+*/
+
+typedef struct {
+  int n;
+  mpc_parser_t **xs;
+  mpc_op_t *table;
+} mpca_ops_t;
+
+static void mpca_ops_delete(mpc_val_t *x) {
+  int i;
+  mpca_ops_t *o = x;
+  for (i = 0; i < o->n; i++) { mpc_soft_delete(o->xs[i]); }
+  free(o->xs);
+  free(o->table);
+  free(o);
+}
+
+static mpc_val_t *mpcaf_fold_binop(int n, mpc_val_t **xs) {
+  
+  int i, j;
+  mpc_ast_t **as = (mpc_ast_t**)xs;
+  mpc_ast_t *r = mpc_ast_new("binop|>", "");
+  
+  for (i = 0; i < n; i++) {
+    if (as[i] == NULL) { continue; }
+    if (as[i]->children_num > 0 && strcmp(as[i]->tag, "binop|>") != 0) {
+      for (j = 0; j < as[i]->children_num; j++) {
+        mpc_ast_add_child(r, as[i]->children[j]);
+      }
+      mpc_ast_delete_no_children(as[i]);
+    } else {
+      mpc_ast_add_child(r, as[i]);
+    }
+  }
+  
+  if (r->children_num) { r->state = r->children[0]->state; }
+  return r;
+}
+
+static mpc_val_t *mpcaf_grammar_ops(int n, mpc_val_t **xs) {
+  int i;
+  mpca_ops_t *o = malloc(sizeof(mpca_ops_t));
+  o->n = n;
+  o->xs = malloc(sizeof(mpc_parser_t*) * n);
+  o->table = malloc(sizeof(mpc_op_t) * n);
+  for (i = 0; i < n; i++) {
+    o->xs[i] = xs[i];
+    o->table[i].op = NULL;
+    o->table[i].prec = 1;
+    o->table[i].assoc = MPC_ASSOC_LEFT;
+    o->table[i].f = mpcaf_fold_binop;
+  }
+  return o;
+}
+
+static mpc_val_t *mpcaf_grammar_level(int n, mpc_val_t **xs) {
+  int i;
+  mpca_ops_t *o = xs[1];
+  (void) n;
+  for (i = 0; i < o->n; i++) {
+    o->table[i].assoc = strcmp(xs[0], "%right") == 0 ? MPC_ASSOC_RIGHT : MPC_ASSOC_LEFT;
+  }
+  free(xs[0]);
+  return o;
+}
+
+static mpc_val_t *mpcaf_grammar_levels(int n, mpc_val_t **xs) {
+  
+  int i, j;
+  mpca_ops_t *l, *o = mpcaf_grammar_ops(0, NULL);
+  
+  for (i = 0; i < n; i++) {
+    l = xs[i];
+    o->xs = realloc(o->xs, sizeof(mpc_parser_t*) * (o->n + l->n));
+    o->table = realloc(o->table, sizeof(mpc_op_t) * (o->n + l->n));
+    for (j = 0; j < l->n; j++) {
+      o->xs[o->n] = l->xs[j];
+      o->table[o->n] = l->table[j];
+      o->table[o->n].prec = i+1;
+      o->n++;
+    }
+    l->n = 0;
+    mpca_ops_delete(l);
+  }
+  
+  return o;
+}
+
+static mpc_val_t *mpcaf_grammar_term(int n, mpc_val_t **xs) {
+  
+  mpc_parser_t *p;
+  mpca_ops_t *o = xs[1];
+  (void) n;
+  
+  if (o == NULL) { return xs[0]; }
+  
+  p = mpc_expr_new(mpca_root(xs[0]), o->n, o->xs, o->table, (mpc_dtor_t)mpc_ast_delete);
+  free(o->table);
+  free(o);
+  return p;
+}
+
+static mpc_parser_t *mpca_term(mpc_parser_t *Factor, mpca_grammar_st_t *st) {
+  
+  mpc_parser_t *Op = mpc_or(2,
+    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st));
+  
+  mpc_parser_t *Level = mpc_and(2, mpcaf_grammar_level,
+    mpc_tok(mpc_and(2, mpcf_strfold, mpc_char('%'), mpc_or(2, mpc_string("left"), mpc_string("right")), free)),
+    mpc_many1(mpcaf_grammar_ops, Op),
+    free);
+  
+  return mpc_and(2, mpcaf_grammar_term,
+    mpc_many1(mpcaf_grammar_and, Factor),
+    mpc_maybe(mpc_many1(mpcaf_grammar_levels, Level)),
+    mpc_soft_delete);
+}
+
 /* Should this just use `isdigit` instead? */
 static int is_number(const char* s) {
   size_t i;
@@ -2861,7 +5386,11 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
   mpc_parser_t *p;
   
   /* Case of Number */
-  if (is_number(x)) {
+  if (is_number(x) && st->va == NULL) {
+    
+    return mpc_failf("No Parser in position %s! Rules of a grammar have names!", x);
+    
+  } else if (is_number(x)) {
 
     i = strtol(x, NULL, 10);
     
@@ -2886,6 +5415,15 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
       if (q->name && strcmp(q->name, x) == 0) { return q; }
     }
     
+    /* Rules of a grammar are made as they come up */
+    if (st->va == NULL) {
+      p = mpc_new(x);
+      st->parsers_num++;
+      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
+      st->parsers[st->parsers_num-1] = p;
+      return p;
+    }
+    
     /* Search New Parsers */
     while (1) {
     
@@ -2917,6 +5455,11 @@ static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   }
 }
 
+static mpc_val_t *mpcaf_grammar_cut(mpc_val_t *x) {
+  free(x);
+  return mpc_cut();
+}
+
 mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
   
   char *err_msg;
@@ -2940,7 +5483,166 @@ mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
     mpc_soft_delete
   ));
   
-  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+  mpc_define(Term, mpca_term(Factor, st));
+  
+  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
+    Base,
+      mpc_or(6,
+        mpc_sym("*"),
+        mpc_sym("+"),
+        mpc_sym("?"),
+        mpc_sym("!"),
+        mpc_tok_brackets(mpc_int(), free),
+        mpc_pass()),
+    mpc_soft_delete
+  ));
+  
+  mpc_define(Base, mpc_or(6,
+    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+    mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
+    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+    mpc_apply(mpc_sym("^"), mpcaf_grammar_cut),
+    mpc_tok_parens(Grammar, mpc_soft_delete)
+  ));
+  
+  if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
+    err_msg = mpc_err_string(r.error);
+    err_out = mpc_failf("Invalid Grammar: %s", err_msg);
+    mpc_err_delete(r.error);
+    free(err_msg);
+    r.output = err_out;
+  }
+  
+  mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+  mpc_lexer_release(st->lexer);
+  
+  if (st->flags & MPCA_LANG_COLLAPSE) { r.output = mpc_apply(r.output, mpcaf_collapse); }
+  return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+  
+}
+
+mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
+  mpca_grammar_st_t st;
+  mpc_parser_t *res;
+  va_list va;
+  va_start(va, grammar);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  st.lexer = NULL;
+  
+  res = mpca_grammar_st(grammar, &st);  
+  free(st.parsers);
+  va_end(va);
+  return res;
+}
+
+typedef struct {
+  char *ident;
+  char *name;
+  mpc_parser_t *grammar;
+} mpca_stmt_t;
+
+static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
+  mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
+  stmt->ident = ((char**)xs)[0];
+  stmt->name = ((char**)xs)[1];
+  stmt->grammar = ((mpc_parser_t**)xs)[3];
+  (void) n;
+  free(((char**)xs)[2]);
+  free(((char**)xs)[4]);
+  
+  return stmt;
+}
+
+static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
+  
+  int i;
+  mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+  
+  for (i = 0; i < n; i++) {
+    stmts[i] = xs[i];
+  }
+  stmts[n] = NULL;  
+  
+  return stmts;
+}
+
+static void mpca_stmt_list_delete(mpc_val_t *x) {
+
+  mpca_stmt_t **stmts = x;
+
+  while(*stmts) {
+    mpca_stmt_t *stmt = *stmts; 
+    free(stmt->ident);
+    free(stmt->name);
+    mpc_soft_delete(stmt->grammar);
+    free(stmt);  
+    stmts++;
+  }
+  free(x);
+
+}
+
+static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
+
+  mpca_grammar_st_t *st = s;
+  mpca_stmt_t *stmt;
+  mpca_stmt_t **stmts = x;
+  mpc_parser_t *left;
+
+  while(*stmts) {
+    stmt = *stmts;
+    left = mpca_grammar_find_parser(stmt->ident, st);
+    if (st->flags & MPCA_LANG_COLLAPSE) { stmt->grammar = mpc_apply(stmt->grammar, mpcaf_collapse); }
+    if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
+    if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    mpc_define(left, stmt->grammar);
+    left->memo = (st->flags & MPCA_LANG_PACKRAT) && !(st->flags & MPCA_LANG_PREDICTIVE);
+    free(stmt->ident);
+    free(stmt->name);
+    free(stmt);
+    stmts++;
+  }
+  free(x);
+  
+  return NULL;
+}
+
+static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
+  
+  int n;
+  mpc_result_t r;
+  mpc_err_t *e;
+  mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base; 
+  
+  Lang    = mpc_new("lang");
+  Stmt    = mpc_new("stmt");
+  Grammar = mpc_new("grammar");
+  Term    = mpc_new("term");
+  Factor  = mpc_new("factor");
+  Base    = mpc_new("base");
+  
+  mpc_define(Lang, mpc_apply_to(
+    mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
+    mpca_stmt_list_apply_to, st
+  ));
+  
+  mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
+    mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
+    free, free, free, mpc_soft_delete
+  ));
+  
+  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
+      Term,
+      mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+      mpc_soft_delete
+  ));
+  
+  mpc_define(Term, mpca_term(Factor, st));
   
   mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
     Base,
@@ -2954,274 +5656,977 @@ mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
     mpc_soft_delete
   ));
   
-  mpc_define(Base, mpc_or(5,
+  mpc_define(Base, mpc_or(6,
     mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
     mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
     mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
     mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+    mpc_apply(mpc_sym("^"), mpcaf_grammar_cut),
     mpc_tok_parens(Grammar, mpc_soft_delete)
   ));
   
-  if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
-    err_msg = mpc_err_string(r.error);
-    err_out = mpc_failf("Invalid Grammar: %s", err_msg);
-    mpc_err_delete(r.error);
-    free(err_msg);
-    r.output = err_out;
+  
+  if (!mpc_parse_input(i, Lang, &r)) {
+    e = r.error;
+  } else {
+    e = NULL;
+    /* A rule that wasn't passed in leaves the closing NULL in the list */
+    n = 0;
+    while (n < st->parsers_num && st->parsers[n]) { n++; }
+    mpc_first_compute(n, st->parsers);
   }
   
-  mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+  mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
+  mpc_lexer_release(st->lexer);
   
-  return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+  return e;
+}
+
+mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+
+  va_list va;  
+  va_start(va, f);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  st.lexer = NULL;
+  
+  i = mpc_input_new_file("<mpca_lang_file>", f);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
   
+  free(st.parsers);
+  va_end(va);
+  return err;
 }
 
-mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
+mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
   mpca_grammar_st_t st;
-  mpc_parser_t *res;
-  va_list va;
-  va_start(va, grammar);
+  mpc_input_t *i;
+  mpc_err_t *err;
+
+  va_list va;  
+  va_start(va, p);
   
   st.va = &va;
   st.parsers_num = 0;
   st.parsers = NULL;
   st.flags = flags;
+  st.lexer = NULL;
+  
+  i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
   
-  res = mpca_grammar_st(grammar, &st);  
   free(st.parsers);
   va_end(va);
-  return res;
+  return err;
+}
+
+mpc_err_t *mpca_lang(int flags, const char *language, ...) {
+  
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+  
+  va_list va;  
+  va_start(va, language);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  st.lexer = NULL;
+  
+  i = mpc_input_new_string("<mpca_lang>", language);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+  
+  free(st.parsers);
+  va_end(va);
+  return err;
+}
+
+mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
+  
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+  
+  va_list va;
+
+  FILE *f = fopen(filename, "rb");
+  
+  if (f == NULL) {
+    return mpc_err_fail(filename, mpc_state_new(), "Unable to open file!");
+  }
+  
+  va_start(va, filename);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  st.lexer = NULL;
+  
+  i = mpc_input_new_file(filename, f);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+  
+  free(st.parsers);
+  va_end(va);  
+  
+  fclose(f);
+  
+  return err;
+}
+
+/*
+** Grammars
+**
+** A grammar owns the rules of a language. Once it is
+** built nothing in it changes, so it can be shared by
+** any number of threads parsing at the same time, each
+** through a context of its own.
+*/
+
+struct mpc_grammar_t {
+  int num;
+  mpc_parser_t **rules;
+};
+
+static void mpca_rules_delete(int n, mpc_parser_t **ps) {
+  int j;
+  for (j = 0; j < n; j++) { mpc_undefine(ps[j]); }
+  for (j = 0; j < n; j++) { mpc_delete(ps[j]); }
+  free(ps);
+}
+
+mpc_err_t *mpca_lang_grammar(int flags, const char *language, mpc_grammar_t **g) {
+  
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+  char *m;
+  int j;
+  
+  st.va = NULL;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  st.lexer = NULL;
+  
+  i = mpc_input_new_string("<mpca_lang_grammar>", language);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+  
+  for (j = 0; err == NULL && j < st.parsers_num; j++) {
+    if (st.parsers[j]->type != MPC_TYPE_UNDEFINED) { continue; }
+    m = malloc(strlen(st.parsers[j]->name) + 32);
+    sprintf(m, "Rule '%s' is never defined!", st.parsers[j]->name);
+    err = mpc_err_fail("<mpca_lang_grammar>", mpc_state_new(), m);
+    free(m);
+  }
+  
+  if (err) {
+    mpca_rules_delete(st.parsers_num, st.parsers);
+    *g = NULL;
+    return err;
+  }
+  
+  *g = malloc(sizeof(mpc_grammar_t));
+  (*g)->num = st.parsers_num;
+  (*g)->rules = st.parsers;
+  return NULL;
+}
+
+mpc_parser_t *mpc_grammar_rule(const mpc_grammar_t *g, const char *name) {
+  int j;
+  for (j = 0; j < g->num; j++) {
+    if (strcmp(g->rules[j]->name, name) == 0) { return g->rules[j]; }
+  }
+  return NULL;
+}
+
+void mpc_grammar_delete(mpc_grammar_t *g) {
+  mpca_rules_delete(g->num, g->rules);
+  free(g);
+}
+
+/*
+** Saved Grammars
+**
+** A grammar is saved as one flat list of its parsers,
+** rules first, with every link between them written
+** as an index into the list. Compiled regexes, lexers
+** and first sets are written out as they are, so that
+** loading a grammar back compiles nothing. Functions
+** are saved by their place in `mpc_grammar_funcs`, so
+** a blob only loads into the version of mpc that saved
+** it, which the version number in the header checks.
+*/
+
+#define MPC_GRAMMAR_VERSION 1
+#define MPC_GRAMMAR_NONE 0xFFFFFFFFUL
+
+typedef void (*mpc_func_t)(void);
+
+static const mpc_func_t mpc_grammar_funcs[] = {
+  NULL,
+  (mpc_func_t)free,
+  (mpc_func_t)mpc_delete,
+  (mpc_func_t)mpc_soft_delete,
+  (mpc_func_t)mpc_ast_delete,
+  (mpc_func_t)mpcf_dtor_null,
+  (mpc_func_t)mpcf_ctor_null,
+  (mpc_func_t)mpcf_ctor_str,
+  (mpc_func_t)mpcf_free,
+  (mpc_func_t)mpcf_int,
+  (mpc_func_t)mpcf_hex,
+  (mpc_func_t)mpcf_oct,
+  (mpc_func_t)mpcf_float,
+  (mpc_func_t)mpcf_escape,
+  (mpc_func_t)mpcf_unescape,
+  (mpc_func_t)mpcf_escape_regex,
+  (mpc_func_t)mpcf_unescape_regex,
+  (mpc_func_t)mpcf_escape_string_raw,
+  (mpc_func_t)mpcf_unescape_string_raw,
+  (mpc_func_t)mpcf_escape_char_raw,
+  (mpc_func_t)mpcf_unescape_char_raw,
+  (mpc_func_t)mpcf_null,
+  (mpc_func_t)mpcf_fst,
+  (mpc_func_t)mpcf_snd,
+  (mpc_func_t)mpcf_trd,
+  (mpc_func_t)mpcf_fst_free,
+  (mpc_func_t)mpcf_snd_free,
+  (mpc_func_t)mpcf_trd_free,
+  (mpc_func_t)mpcf_strfold,
+  (mpc_func_t)mpcf_maths,
+  (mpc_func_t)mpcf_fold_ast,
+  (mpc_func_t)mpcf_str_ast,
+  (mpc_func_t)mpcf_state_ast,
+  (mpc_func_t)mpc_ast_add_root,
+  (mpc_func_t)mpc_ast_tag_interned,
+  (mpc_func_t)mpc_ast_add_tag_interned,
+  (mpc_func_t)mpcaf_collapse,
+  (mpc_func_t)mpcaf_fold_binop,
+  (mpc_func_t)mpc_soi_anchor,
+  (mpc_func_t)mpc_eoi_anchor,
+  (mpc_func_t)mpc_boundary_anchor
+};
+
+#define MPC_GRAMMAR_FUNCS (sizeof(mpc_grammar_funcs) / sizeof(mpc_func_t))
+
+typedef struct {
+  int num;
+  void **xs;
+} mpc_ptrs_t;
+
+static int mpc_ptrs_index(const mpc_ptrs_t *l, const void *x) {
+  int j;
+  for (j = 0; j < l->num; j++) {
+    if (l->xs[j] == x) { return j; }
+  }
+  return -1;
+}
+
+static void mpc_ptrs_add(mpc_ptrs_t *l, void *x) {
+  if (mpc_ptrs_index(l, x) >= 0) { return; }
+  l->xs = realloc(l->xs, sizeof(void*) * (l->num + 1));
+  l->xs[l->num++] = x;
+}
+
+typedef struct {
+  mpc_ptrs_t parsers;
+  mpc_ptrs_t dfas;
+  mpc_ptrs_t lexers;
+  char *s;
+  long len, max;
+  int bad;
+} mpc_saver_t;
+
+static void mpc_saver_bytes(mpc_saver_t *s, const void *x, long n) {
+  while (s->len + n > s->max) {
+    s->max = s->max ? s->max * 2 : 4096;
+    s->s = realloc(s->s, s->max);
+  }
+  memcpy(s->s + s->len, x, n);
+  s->len += n;
+}
+
+static void mpc_saver_u32(mpc_saver_t *s, unsigned long x) {
+  unsigned char b[4];
+  b[0] = (unsigned char)(x & 0xFF);
+  b[1] = (unsigned char)((x >> 8) & 0xFF);
+  b[2] = (unsigned char)((x >> 16) & 0xFF);
+  b[3] = (unsigned char)((x >> 24) & 0xFF);
+  mpc_saver_bytes(s, b, 4);
+}
+
+static void mpc_saver_int(mpc_saver_t *s, int x) {
+  mpc_saver_u32(s, (unsigned long)(long)x & 0xFFFFFFFFUL);
+}
+
+static void mpc_saver_str(mpc_saver_t *s, const char *x) {
+  if (x == NULL) { mpc_saver_u32(s, MPC_GRAMMAR_NONE); return; }
+  mpc_saver_u32(s, strlen(x));
+  mpc_saver_bytes(s, x, strlen(x));
+}
+
+static void mpc_saver_func(mpc_saver_t *s, mpc_func_t f) {
+  unsigned long j;
+  for (j = 0; j < MPC_GRAMMAR_FUNCS; j++) {
+    if (mpc_grammar_funcs[j] == f) { mpc_saver_u32(s, j); return; }
+  }
+  s->bad = 1;
+}
+
+static void mpc_saver_parser(mpc_saver_t *s, mpc_parser_t *p) {
+  mpc_saver_u32(s, mpc_ptrs_index(&s->parsers, p));
+}
+
+static void mpc_saver_run(mpc_saver_t *s, const mpc_run_t *r) {
+  mpc_saver_bytes(s, r->set, 32);
+  mpc_saver_int(s, r->ranges);
+  mpc_saver_bytes(s, r->lo, MPC_RUN_RANGES);
+  mpc_saver_bytes(s, r->len, MPC_RUN_RANGES);
+  mpc_saver_bytes(s, &r->drop, 1);
+}
+
+/* Adds every parser, regex and lexer that `p` uses to the lists */
+static void mpc_saver_collect(mpc_saver_t *s, mpc_parser_t *p) {
+  
+  int j;
+  mpc_lexer_t *l;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_EXPECT:   mpc_ptrs_add(&s->parsers, p->data.expect.x);   break;
+    case MPC_TYPE_APPLY:    mpc_ptrs_add(&s->parsers, p->data.apply.x);    break;
+    case MPC_TYPE_APPLY_TO: mpc_ptrs_add(&s->parsers, p->data.apply_to.x); break;
+    case MPC_TYPE_PREDICT:  mpc_ptrs_add(&s->parsers, p->data.predict.x);  break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      mpc_ptrs_add(&s->parsers, p->data.not.x);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_ptrs_add(&s->parsers, p->data.repeat.x);
+      break;
+    
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) { mpc_ptrs_add(&s->parsers, p->data.or.xs[j]); }
+      break;
+    
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) { mpc_ptrs_add(&s->parsers, p->data.and.xs[j]); }
+      break;
+    
+    case MPC_TYPE_EXPR:
+      mpc_ptrs_add(&s->parsers, p->data.expr.x);
+      for (j = 0; j < p->data.expr.n; j++) { mpc_ptrs_add(&s->parsers, p->data.expr.ops[j]); }
+      break;
+    
+    case MPC_TYPE_DFA:
+      mpc_ptrs_add(&s->dfas, p->data.dfa.d);
+      mpc_ptrs_add(&s->parsers, p->data.dfa.x);
+      break;
+    
+    case MPC_TYPE_RUN:
+      mpc_ptrs_add(&s->parsers, p->data.run.x);
+      break;
+    
+    case MPC_TYPE_TOKEN:
+      l = p->data.token.l;
+      mpc_ptrs_add(&s->lexers, l);
+      for (j = 0; j < l->num; j++) {
+        if (l->res[j]) { mpc_ptrs_add(&s->parsers, l->res[j]); }
+      }
+      mpc_ptrs_add(&s->parsers, p->data.token.x);
+      break;
+    
+    default: break;
+  }
+  
+}
+
+static void mpc_saver_write(mpc_saver_t *s, mpc_parser_t *p) {
+  
+  int j;
+  
+  mpc_saver_u32(s, (unsigned long)p->type);
+  mpc_saver_bytes(s, &p->retained, 1);
+  mpc_saver_bytes(s, &p->span, 1);
+  mpc_saver_bytes(s, &p->memo, 1);
+  mpc_saver_bytes(s, &p->nullable, 1);
+  mpc_saver_bytes(s, &p->first_known, 1);
+  mpc_saver_bytes(s, p->first, 32);
+  mpc_saver_str(s, p->name);
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: mpc_saver_str(s, p->data.fail.m); break;
+    
+    case MPC_TYPE_LIFT: mpc_saver_func(s, (mpc_func_t)p->data.lift.lf); break;
+    
+    /* Lifted values can't be written out */
+    case MPC_TYPE_LIFT_VAL: if (p->data.lift.x) { s->bad = 1; } break;
+    
+    case MPC_TYPE_EXPECT:
+      mpc_saver_parser(s, p->data.expect.x);
+      mpc_saver_str(s, p->data.expect.m);
+      break;
+    
+    case MPC_TYPE_ANCHOR:  mpc_saver_func(s, (mpc_func_t)p->data.anchor.f);  break;
+    case MPC_TYPE_SATISFY: mpc_saver_func(s, (mpc_func_t)p->data.satisfy.f); break;
+    case MPC_TYPE_SINGLE:  mpc_saver_bytes(s, &p->data.single.x, 1);         break;
+    case MPC_TYPE_STRING:  mpc_saver_str(s, p->data.string.x);               break;
+    
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      mpc_saver_str(s, p->data.charset.x);
+      mpc_saver_bytes(s, p->data.charset.s, 32);
+      break;
+    
+    case MPC_TYPE_APPLY:
+      mpc_saver_parser(s, p->data.apply.x);
+      mpc_saver_func(s, (mpc_func_t)p->data.apply.f);
+      break;
+    
+    /* Only the data of the tagging functions is known to be a string */
+    case MPC_TYPE_APPLY_TO:
+      mpc_saver_parser(s, p->data.apply_to.x);
+      mpc_saver_func(s, (mpc_func_t)p->data.apply_to.f);
+      if (p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag_interned
+      ||  p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag_interned) {
+        mpc_saver_str(s, p->data.apply_to.d);
+      } else if (p->data.apply_to.d) {
+        s->bad = 1;
+      } else {
+        mpc_saver_str(s, NULL);
+      }
+      break;
+    
+    case MPC_TYPE_PREDICT: mpc_saver_parser(s, p->data.predict.x); break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      mpc_saver_parser(s, p->data.not.x);
+      mpc_saver_func(s, (mpc_func_t)p->data.not.dx);
+      mpc_saver_func(s, (mpc_func_t)p->data.not.lf);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_saver_int(s, p->data.repeat.n);
+      mpc_saver_func(s, (mpc_func_t)p->data.repeat.f);
+      mpc_saver_parser(s, p->data.repeat.x);
+      mpc_saver_func(s, (mpc_func_t)p->data.repeat.dx);
+      break;
+    
+    case MPC_TYPE_OR:
+      mpc_saver_u32(s, p->data.or.n);
+      for (j = 0; j < p->data.or.n; j++) { mpc_saver_parser(s, p->data.or.xs[j]); }
+      break;
+    
+    case MPC_TYPE_AND:
+      mpc_saver_u32(s, p->data.and.n);
+      mpc_saver_func(s, (mpc_func_t)p->data.and.f);
+      for (j = 0; j < p->data.and.n; j++) { mpc_saver_parser(s, p->data.and.xs[j]); }
+      for (j = 0; j < p->data.and.n-1; j++) { mpc_saver_func(s, (mpc_func_t)p->data.and.dxs[j]); }
+      break;
+    
+    case MPC_TYPE_DFA:
+      mpc_saver_u32(s, mpc_ptrs_index(&s->dfas, p->data.dfa.d));
+      mpc_saver_parser(s, p->data.dfa.x);
+      break;
+    
+    case MPC_TYPE_RUN:
+      mpc_saver_run(s, p->data.run.r);
+      mpc_saver_parser(s, p->data.run.x);
+      break;
+    
+    case MPC_TYPE_TOKEN:
+      mpc_saver_u32(s, mpc_ptrs_index(&s->lexers, p->data.token.l));
+      mpc_saver_int(s, p->data.token.id);
+      mpc_saver_bytes(s, &p->data.token.blank, 1);
+      mpc_saver_parser(s, p->data.token.x);
+      mpc_saver_str(s, p->data.token.m);
+      break;
+    
+    /* Operator strings belong to the caller of `mpc_expr` */
+    case MPC_TYPE_EXPR:
+      mpc_saver_u32(s, p->data.expr.n);
+      mpc_saver_parser(s, p->data.expr.x);
+      for (j = 0; j < p->data.expr.n; j++) {
+        if (p->data.expr.table[j].op) { s->bad = 1; }
+        mpc_saver_parser(s, p->data.expr.ops[j]);
+        mpc_saver_int(s, p->data.expr.table[j].prec);
+        mpc_saver_int(s, p->data.expr.table[j].assoc);
+        mpc_saver_func(s, (mpc_func_t)p->data.expr.table[j].f);
+      }
+      mpc_saver_func(s, (mpc_func_t)p->data.expr.dop);
+      break;
+    
+    default: break;
+  }
+  
 }
 
-typedef struct {
-  char *ident;
-  char *name;
-  mpc_parser_t *grammar;
-} mpca_stmt_t;
+static void mpc_saver_dfa(mpc_saver_t *s, const mpc_dfa_t *d) {
+  
+  int j;
+  unsigned char b[2];
+  
+  mpc_saver_str(s, d->re);
+  mpc_saver_u32(s, d->states);
+  for (j = 0; j < d->states * 256; j++) {
+    b[0] = (unsigned char)((unsigned short)d->trans[j] & 0xFF);
+    b[1] = (unsigned char)((unsigned short)d->trans[j] >> 8);
+    mpc_saver_bytes(s, b, 2);
+  }
+  mpc_saver_bytes(s, d->eof, d->states);
+}
 
-static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
-  mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
-  stmt->ident = ((char**)xs)[0];
-  stmt->name = ((char**)xs)[1];
-  stmt->grammar = ((mpc_parser_t**)xs)[3];
-  (void) n;
-  free(((char**)xs)[2]);
-  free(((char**)xs)[4]);
+static void mpc_saver_lexer(mpc_saver_t *s, const mpc_lexer_t *l) {
   
-  return stmt;
+  int t;
+  
+  mpc_saver_u32(s, l->num);
+  mpc_saver_run(s, &l->blank);
+  for (t = 0; t < l->num; t++) {
+    mpc_saver_str(s, l->texts[t]);
+    mpc_saver_bytes(s, &l->literal[t], 1);
+    if (l->res[t]) { mpc_saver_parser(s, l->res[t]); }
+    else { mpc_saver_u32(s, MPC_GRAMMAR_NONE); }
+  }
 }
 
-static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
+int mpc_grammar_save(const mpc_grammar_t *g, char **blob, long *len) {
   
-  int i;
-  mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+  int j;
+  mpc_saver_t s;
   
-  for (i = 0; i < n; i++) {
-    stmts[i] = xs[i];
+  memset(&s, 0, sizeof(mpc_saver_t));
+  
+  for (j = 0; j < g->num; j++) { mpc_ptrs_add(&s.parsers, g->rules[j]); }
+  for (j = 0; j < s.parsers.num; j++) { mpc_saver_collect(&s, s.parsers.xs[j]); }
+  
+  mpc_saver_bytes(&s, "MPCG", 4);
+  mpc_saver_u32(&s, MPC_GRAMMAR_VERSION);
+  mpc_saver_u32(&s, MPC_GRAMMAR_FUNCS);
+  mpc_saver_u32(&s, g->num);
+  mpc_saver_u32(&s, s.parsers.num);
+  mpc_saver_u32(&s, s.dfas.num);
+  mpc_saver_u32(&s, s.lexers.num);
+  
+  for (j = 0; j < s.dfas.num; j++) { mpc_saver_dfa(&s, s.dfas.xs[j]); }
+  for (j = 0; j < s.lexers.num; j++) { mpc_saver_lexer(&s, s.lexers.xs[j]); }
+  for (j = 0; j < s.parsers.num; j++) { mpc_saver_write(&s, s.parsers.xs[j]); }
+  
+  free(s.parsers.xs);
+  free(s.dfas.xs);
+  free(s.lexers.xs);
+  
+  if (s.bad) {
+    free(s.s);
+    *blob = NULL;
+    *len = 0;
+    return 0;
   }
-  stmts[n] = NULL;  
   
-  return stmts;
+  *blob = s.s;
+  *len = s.len;
+  return 1;
 }
 
-static void mpca_stmt_list_delete(mpc_val_t *x) {
-
-  mpca_stmt_t **stmts = x;
+/*
+** While loading every parser is kept marked as retained
+** so that, if the blob turns out to be bad, each one can
+** be undefined alone without reaching into the others.
+** A blob that loads must give each unretained parser
+** exactly one owner, as deleting the grammar relies on.
+*/
 
-  while(*stmts) {
-    mpca_stmt_t *stmt = *stmts; 
-    free(stmt->ident);
-    free(stmt->name);
-    mpc_soft_delete(stmt->grammar);
-    free(stmt);  
-    stmts++;
+typedef struct {
+  const unsigned char *s;
+  long len, pos;
+  int bad;
+  unsigned long num, dfas_num, lexers_num;
+  mpc_parser_t **ps;
+  mpc_dfa_t **dfas;
+  mpc_lexer_t **lexers;
+  char *retained;
+  int *owners;
+} mpc_loader_t;
+
+static void mpc_loader_bytes(mpc_loader_t *l, void *x, long n) {
+  if (l->bad || n > l->len - l->pos) {
+    l->bad = 1;
+    memset(x, 0, n);
+    return;
   }
-  free(x);
+  memcpy(x, l->s + l->pos, n);
+  l->pos += n;
+}
 
+static unsigned long mpc_loader_u32(mpc_loader_t *l) {
+  unsigned char b[4];
+  mpc_loader_bytes(l, b, 4);
+  return (unsigned long)b[0]
+    | ((unsigned long)b[1] << 8)
+    | ((unsigned long)b[2] << 16)
+    | ((unsigned long)b[3] << 24);
 }
 
-static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
+static int mpc_loader_int(mpc_loader_t *l) {
+  unsigned long x = mpc_loader_u32(l);
+  return x > 0x7FFFFFFFUL ? -(int)(0xFFFFFFFFUL - x) - 1 : (int)x;
+}
 
-  mpca_grammar_st_t *st = s;
-  mpca_stmt_t *stmt;
-  mpca_stmt_t **stmts = x;
-  mpc_parser_t *left;
+static char mpc_loader_char(mpc_loader_t *l) {
+  char c;
+  mpc_loader_bytes(l, &c, 1);
+  return c;
+}
 
-  while(*stmts) {
-    stmt = *stmts;
-    left = mpca_grammar_find_parser(stmt->ident, st);
-    if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
-    if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
-    mpc_define(left, stmt->grammar);
-    free(stmt->ident);
-    free(stmt->name);
-    free(stmt);
-    stmts++;
-  }
-  free(x);
-  
-  return NULL;
+/* Reads a count of things at least `size` bytes each, so it can't be too big */
+static unsigned long mpc_loader_count(mpc_loader_t *l, long size) {
+  unsigned long n = mpc_loader_u32(l);
+  if (n > (unsigned long)((l->len - l->pos) / size)) { l->bad = 1; return 0; }
+  return n;
 }
 
-static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
+static char *mpc_loader_str(mpc_loader_t *l) {
   
-  mpc_result_t r;
-  mpc_err_t *e;
-  mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base; 
+  char *x;
+  unsigned long n = mpc_loader_u32(l);
   
-  Lang    = mpc_new("lang");
-  Stmt    = mpc_new("stmt");
-  Grammar = mpc_new("grammar");
-  Term    = mpc_new("term");
-  Factor  = mpc_new("factor");
-  Base    = mpc_new("base");
+  if (l->bad || n == MPC_GRAMMAR_NONE) { return NULL; }
+  if (n > (unsigned long)(l->len - l->pos)) { l->bad = 1; return NULL; }
   
-  mpc_define(Lang, mpc_apply_to(
-    mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
-    mpca_stmt_list_apply_to, st
-  ));
+  x = malloc(n + 1);
+  mpc_loader_bytes(l, x, n);
+  x[n] = '\0';
+  return x;
+}
+
+static mpc_func_t mpc_loader_func(mpc_loader_t *l) {
+  unsigned long j = mpc_loader_u32(l);
+  if (j >= MPC_GRAMMAR_FUNCS) { l->bad = 1; return NULL; }
+  return mpc_grammar_funcs[j];
+}
+
+/* A bad index gives the first rule, which is retained, so nothing is lost */
+static mpc_parser_t *mpc_loader_at(mpc_loader_t *l, unsigned long j) {
+  if (j >= l->num) { l->bad = 1; return l->ps[0]; }
+  l->owners[j]++;
+  return l->ps[j];
+}
+
+static mpc_parser_t *mpc_loader_parser(mpc_loader_t *l) {
+  return mpc_loader_at(l, mpc_loader_u32(l));
+}
+
+static void mpc_loader_run(mpc_loader_t *l, mpc_run_t *r) {
+  mpc_loader_bytes(l, r->set, 32);
+  r->ranges = mpc_loader_int(l);
+  mpc_loader_bytes(l, r->lo, MPC_RUN_RANGES);
+  mpc_loader_bytes(l, r->len, MPC_RUN_RANGES);
+  r->drop = mpc_loader_char(l);
+  if (r->ranges < 0 || r->ranges > MPC_RUN_RANGES) { l->bad = 1; r->ranges = 0; }
+}
+
+static mpc_dfa_t *mpc_loader_dfa(mpc_loader_t *l) {
   
-  mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
-    mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
-    free, free, free, mpc_soft_delete
-  ));
+  int j, x;
+  unsigned char b[2];
+  mpc_dfa_t *d = malloc(sizeof(mpc_dfa_t));
   
-  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-      Term,
-      mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-      mpc_soft_delete
-  ));
+  d->re = mpc_loader_str(l);
+  d->refs = 0;
+  d->states = (int)mpc_loader_count(l, 257);
+  d->trans = malloc(sizeof(short) * 256 * d->states);
+  d->eof = malloc(d->states);
+  d->next = NULL;
   
-  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+  for (j = 0; j < d->states * 256; j++) {
+    mpc_loader_bytes(l, b, 2);
+    x = b[0] | (b[1] << 8);
+    x = x > 0x7FFF ? x - 0x10000 : x;
+    if (x < MPC_DFA_FAIL || x >= d->states) { l->bad = 1; x = MPC_DFA_FAIL; }
+    d->trans[j] = (short)x;
+  }
+  mpc_loader_bytes(l, d->eof, d->states);
   
-  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-    Base,
-      mpc_or(6,
-        mpc_sym("*"),
-        mpc_sym("+"),
-        mpc_sym("?"),
-        mpc_sym("!"),
-        mpc_tok_brackets(mpc_int(), free),
-        mpc_pass()),
-    mpc_soft_delete
-  ));
+  if (d->re == NULL || d->states == 0) { l->bad = 1; }
+  return d;
+}
+
+static mpc_lexer_t *mpc_loader_lexer(mpc_loader_t *l) {
   
-  mpc_define(Base, mpc_or(5,
-    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-    mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
-    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-    mpc_tok_parens(Grammar, mpc_soft_delete)
-  ));
+  int t;
+  unsigned long j;
+  mpc_lexer_t *x = mpc_lexer_new();
   
+  x->refs = 0;
+  x->num = (int)mpc_loader_count(l, 9);
+  x->texts = calloc(x->num, sizeof(char*));
+  x->literal = calloc(x->num, sizeof(char));
+  x->res = calloc(x->num, sizeof(mpc_parser_t*));
+  mpc_loader_run(l, &x->blank);
   
-  if (!mpc_parse_input(i, Lang, &r)) {
-    e = r.error;
-  } else {
-    e = NULL;
+  for (t = 0; t < x->num; t++) {
+    x->texts[t] = mpc_loader_str(l);
+    x->literal[t] = mpc_loader_char(l);
+    j = mpc_loader_u32(l);
+    if (j != MPC_GRAMMAR_NONE) { x->res[t] = mpc_loader_at(l, j); }
+    if (x->texts[t] == NULL || (!x->literal[t] && x->res[t] == NULL)) { l->bad = 1; }
   }
   
-  mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
-  
-  return e;
+  return x;
 }
 
-mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
-
-  va_list va;  
-  va_start(va, f);
+static void mpc_loader_read(mpc_loader_t *l, mpc_parser_t *p, unsigned long i) {
   
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+  int j;
+  char *t;
+  unsigned long n, k;
+  unsigned long type = mpc_loader_u32(l);
   
-  i = mpc_input_new_file("<mpca_lang_file>", f);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+  l->retained[i] = mpc_loader_char(l);
+  p->span = mpc_loader_char(l);
+  p->memo = mpc_loader_char(l);
+  p->nullable = mpc_loader_char(l);
+  p->first_known = mpc_loader_char(l);
+  mpc_loader_bytes(l, p->first, 32);
+  p->name = mpc_loader_str(l);
   
-  free(st.parsers);
-  va_end(va);
-  return err;
-}
-
-mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
-
-  va_list va;  
-  va_start(va, p);
+  if (type == MPC_TYPE_UNDEFINED || type > MPC_TYPE_CUT) { l->bad = 1; }
+  if (l->bad) { return; }
   
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+  p->type = (char)type;
   
-  i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: p->data.fail.m = mpc_loader_str(l); break;
+    
+    case MPC_TYPE_LIFT:     p->data.lift.lf = (mpc_ctor_t)mpc_loader_func(l); break;
+    case MPC_TYPE_LIFT_VAL: p->data.lift.x = NULL;                            break;
+    
+    case MPC_TYPE_EXPECT:
+      p->data.expect.x = mpc_loader_parser(l);
+      p->data.expect.m = mpc_loader_str(l);
+      break;
+    
+    case MPC_TYPE_ANCHOR:  p->data.anchor.f = (int(*)(char,char))mpc_loader_func(l); break;
+    case MPC_TYPE_SATISFY: p->data.satisfy.f = (int(*)(char))mpc_loader_func(l);     break;
+    case MPC_TYPE_SINGLE:  p->data.single.x = mpc_loader_char(l);                    break;
+    case MPC_TYPE_STRING:  p->data.string.x = mpc_loader_str(l);                     break;
+    
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      p->data.charset.x = mpc_loader_str(l);
+      mpc_loader_bytes(l, p->data.charset.s, 32);
+      break;
+    
+    case MPC_TYPE_APPLY:
+      p->data.apply.x = mpc_loader_parser(l);
+      p->data.apply.f = (mpc_apply_t)mpc_loader_func(l);
+      break;
+    
+    case MPC_TYPE_APPLY_TO:
+      p->data.apply_to.x = mpc_loader_parser(l);
+      p->data.apply_to.f = (mpc_apply_to_t)mpc_loader_func(l);
+      t = mpc_loader_str(l);
+      p->data.apply_to.d = t ? (void*)mpc_intern(t) : NULL;
+      free(t);
+      break;
+    
+    case MPC_TYPE_PREDICT: p->data.predict.x = mpc_loader_parser(l); break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      p->data.not.x = mpc_loader_parser(l);
+      p->data.not.dx = (mpc_dtor_t)mpc_loader_func(l);
+      p->data.not.lf = (mpc_ctor_t)mpc_loader_func(l);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      p->data.repeat.n = mpc_loader_int(l);
+      p->data.repeat.f = (mpc_fold_t)mpc_loader_func(l);
+      p->data.repeat.x = mpc_loader_parser(l);
+      p->data.repeat.dx = (mpc_dtor_t)mpc_loader_func(l);
+      break;
+    
+    case MPC_TYPE_OR:
+      n = mpc_loader_count(l, 4);
+      p->data.or.n = (int)n;
+      p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+      for (j = 0; j < p->data.or.n; j++) { p->data.or.xs[j] = mpc_loader_parser(l); }
+      break;
+    
+    case MPC_TYPE_AND:
+      n = mpc_loader_count(l, 4);
+      if (n == 0) { l->bad = 1; p->type = MPC_TYPE_UNDEFINED; break; }
+      p->data.and.n = (int)n;
+      p->data.and.f = (mpc_fold_t)mpc_loader_func(l);
+      p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+      p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+      for (j = 0; j < p->data.and.n; j++) { p->data.and.xs[j] = mpc_loader_parser(l); }
+      for (j = 0; j < p->data.and.n-1; j++) { p->data.and.dxs[j] = (mpc_dtor_t)mpc_loader_func(l); }
+      break;
+    
+    case MPC_TYPE_DFA:
+      k = mpc_loader_u32(l);
+      if (k >= l->dfas_num) { l->bad = 1; p->type = MPC_TYPE_UNDEFINED; break; }
+      p->data.dfa.d = l->dfas[k];
+      p->data.dfa.d->refs++;
+      p->data.dfa.x = mpc_loader_parser(l);
+      break;
+    
+    case MPC_TYPE_RUN:
+      p->data.run.r = malloc(sizeof(mpc_run_t));
+      mpc_loader_run(l, p->data.run.r);
+      p->data.run.x = mpc_loader_parser(l);
+      break;
+    
+    case MPC_TYPE_TOKEN:
+      k = mpc_loader_u32(l);
+      if (k >= l->lexers_num) { l->bad = 1; p->type = MPC_TYPE_UNDEFINED; break; }
+      p->data.token.l = l->lexers[k];
+      p->data.token.l->refs++;
+      p->data.token.id = mpc_loader_int(l);
+      p->data.token.blank = mpc_loader_char(l);
+      p->data.token.x = mpc_loader_parser(l);
+      p->data.token.m = mpc_loader_str(l);
+      if (p->data.token.id < 0 || p->data.token.id >= p->data.token.l->num) { l->bad = 1; }
+      break;
+    
+    case MPC_TYPE_EXPR:
+      n = mpc_loader_count(l, 16);
+      p->data.expr.n = (int)n;
+      p->data.expr.x = mpc_loader_parser(l);
+      p->data.expr.ops = malloc(sizeof(mpc_parser_t*) * n);
+      p->data.expr.table = malloc(sizeof(mpc_op_t) * n);
+      for (j = 0; j < p->data.expr.n; j++) {
+        p->data.expr.ops[j] = mpc_loader_parser(l);
+        p->data.expr.table[j].op = NULL;
+        p->data.expr.table[j].prec = mpc_loader_int(l);
+        p->data.expr.table[j].assoc = mpc_loader_int(l);
+        p->data.expr.table[j].f = (mpc_fold_t)mpc_loader_func(l);
+      }
+      p->data.expr.dop = (mpc_dtor_t)mpc_loader_func(l);
+      break;
+    
+    default: break;
+  }
   
-  free(st.parsers);
-  va_end(va);
-  return err;
 }
 
-mpc_err_t *mpca_lang(int flags, const char *language, ...) {
+static void mpc_loader_delete(mpc_loader_t *l) {
   
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+  int t;
+  unsigned long j;
   
-  va_list va;  
-  va_start(va, language);
+  /* Regex parsers of the lexers are in the list with the rest */
+  for (j = 0; j < l->lexers_num; j++) {
+    for (t = 0; t < l->lexers[j]->num; t++) { l->lexers[j]->res[t] = NULL; }
+    l->lexers[j]->refs++;
+    mpc_lexer_release(l->lexers[j]);
+  }
   
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+  for (j = 0; j < l->dfas_num; j++) {
+    l->dfas[j]->refs++;
+    mpc_dfa_release(l->dfas[j]);
+  }
   
-  i = mpc_input_new_string("<mpca_lang>", language);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+  for (j = 0; j < l->num; j++) { mpc_undefine_unretained(l->ps[j], 1); }
+  for (j = 0; j < l->num; j++) { free(l->ps[j]->name); free(l->ps[j]); }
   
-  free(st.parsers);
-  va_end(va);
-  return err;
+  free(l->ps);
+  free(l->dfas);
+  free(l->lexers);
+  free(l->retained);
+  free(l->owners);
 }
 
-mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
+mpc_grammar_t *mpc_grammar_load(const char *blob, long len) {
   
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+  char magic[4];
+  unsigned long j, rules;
+  mpc_loader_t l;
+  mpc_grammar_t *g;
   
-  va_list va;
-
-  FILE *f = fopen(filename, "rb");
+  memset(&l, 0, sizeof(mpc_loader_t));
+  l.s = (const unsigned char*)blob;
+  l.len = len;
   
-  if (f == NULL) {
-    return mpc_err_fail(filename, mpc_state_new(), "Unable to open file!");
+  mpc_loader_bytes(&l, magic, 4);
+  if (memcmp(magic, "MPCG", 4) != 0
+  ||  mpc_loader_u32(&l) != MPC_GRAMMAR_VERSION
+  ||  mpc_loader_u32(&l) != MPC_GRAMMAR_FUNCS) { return NULL; }
+  
+  rules = mpc_loader_u32(&l);
+  l.num = mpc_loader_count(&l, 45);
+  l.dfas_num = mpc_loader_count(&l, 265);
+  l.lexers_num = mpc_loader_count(&l, 49);
+  if (l.bad || rules == 0 || rules > l.num) { return NULL; }
+  
+  l.ps = malloc(sizeof(mpc_parser_t*) * l.num);
+  l.retained = calloc(l.num, sizeof(char));
+  l.owners = calloc(l.num, sizeof(int));
+  for (j = 0; j < l.num; j++) {
+    l.ps[j] = mpc_undefined();
+    l.ps[j]->retained = 1;
   }
   
-  va_start(va, filename);
+  l.dfas = malloc(sizeof(mpc_dfa_t*) * l.dfas_num);
+  for (j = 0; j < l.dfas_num; j++) { l.dfas[j] = mpc_loader_dfa(&l); }
   
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+  l.lexers = malloc(sizeof(mpc_lexer_t*) * l.lexers_num);
+  for (j = 0; j < l.lexers_num; j++) { l.lexers[j] = mpc_loader_lexer(&l); }
   
-  i = mpc_input_new_file(filename, f);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+  for (j = 0; j < l.num; j++) { mpc_loader_read(&l, l.ps[j], j); }
   
-  free(st.parsers);
-  va_end(va);  
+  if (l.pos != l.len) { l.bad = 1; }
   
-  fclose(f);
+  for (j = 0; j < l.num; j++) {
+    if (j < rules && (!l.retained[j] || l.ps[j]->name == NULL)) { l.bad = 1; }
+    if (j >= rules && (l.retained[j] || l.owners[j] != 1)) { l.bad = 1; }
+  }
+  for (j = 0; j < l.dfas_num; j++) { if (l.dfas[j]->refs == 0) { l.bad = 1; } }
+  for (j = 0; j < l.lexers_num; j++) { if (l.lexers[j]->refs == 0) { l.bad = 1; } }
   
-  return err;
+  if (l.bad) {
+    mpc_loader_delete(&l);
+    return NULL;
+  }
+  
+  for (j = 0; j < l.num; j++) { l.ps[j]->retained = l.retained[j]; }
+  
+  g = malloc(sizeof(mpc_grammar_t));
+  g->num = (int)rules;
+  g->rules = malloc(sizeof(mpc_parser_t*) * rules);
+  memcpy(g->rules, l.ps, sizeof(mpc_parser_t*) * rules);
+  
+  free(l.ps);
+  free(l.dfas);
+  free(l.lexers);
+  free(l.retained);
+  free(l.owners);
+  return g;
 }
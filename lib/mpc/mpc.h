@@ -59,11 +59,27 @@ typedef union {
 struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
+struct mpc_arena_t;
+typedef struct mpc_arena_t mpc_arena_t;
+
+mpc_arena_t *mpc_arena_new(void);
+void mpc_arena_free(mpc_arena_t *a);
+
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_borrowed(const char *filename, const char *ptr, long len, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_arena(const char *filename, const char *ptr, long len, mpc_arena_t *a, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+struct mpc_context_t;
+typedef struct mpc_context_t mpc_context_t;
+
+mpc_context_t *mpc_context_new(void);
+void mpc_context_delete(mpc_context_t *c);
+
+int mpc_parse_context(const char *filename, const char *ptr, long len, mpc_context_t *c, mpc_arena_t *a, mpc_parser_t *p, mpc_result_t *r);
+
 /*
 ** Function Types
 */
@@ -103,6 +119,7 @@ mpc_parser_t *mpc_string(const char *s);
 */
 
 mpc_parser_t *mpc_pass(void);
+mpc_parser_t *mpc_cut(void);
 mpc_parser_t *mpc_fail(const char *m);
 mpc_parser_t *mpc_failf(const char *fmt, ...);
 mpc_parser_t *mpc_lift(mpc_ctor_t f);
@@ -131,6 +148,20 @@ mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da);
 mpc_parser_t *mpc_or(int n, ...);
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
+enum {
+  MPC_ASSOC_LEFT  = 0,
+  MPC_ASSOC_RIGHT = 1
+};
+
+typedef struct {
+  const char *op;
+  int prec;
+  int assoc;
+  mpc_fold_t f;
+} mpc_op_t;
+
+mpc_parser_t *mpc_expr(mpc_parser_t *a, const mpc_op_t *ops);
+
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
 
 /*
@@ -145,6 +176,8 @@ mpc_parser_t *mpc_boundary(void);
 mpc_parser_t *mpc_whitespace(void);
 mpc_parser_t *mpc_whitespaces(void);
 mpc_parser_t *mpc_blank(void);
+mpc_parser_t *mpc_blank_run(void);
+mpc_parser_t *mpc_class_run(const char *s);
 
 mpc_parser_t *mpc_newline(void);
 mpc_parser_t *mpc_tab(void);
@@ -259,8 +292,12 @@ typedef struct mpc_ast_t {
   struct mpc_ast_t** children;
 } mpc_ast_t;
 
+const char *mpc_intern(const char *s);
+void mpc_intern_cleanup(void);
+
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
@@ -276,6 +313,40 @@ void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
 */
 int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b);
 
+/*
+** Flattened AST
+*/
+
+#define MPC_FLAT_NONE ((unsigned int)-1)
+
+typedef struct {
+  unsigned int tag;
+  unsigned int parent;
+  unsigned int next;
+  unsigned int children_num;
+  unsigned int contents;
+  unsigned int length;
+  mpc_state_t state;
+} mpc_flat_node_t;
+
+typedef struct {
+  unsigned long size;
+  unsigned long nodes_num;
+  unsigned long tags_num;
+  unsigned long strings;
+} mpc_flat_t;
+
+mpc_flat_t *mpc_ast_flatten(mpc_ast_t *a);
+mpc_flat_t *mpc_flat_copy(const mpc_flat_t *f);
+void mpc_flat_delete(mpc_flat_t *f);
+
+mpc_flat_node_t *mpc_flat_node(const mpc_flat_t *f, unsigned int i);
+unsigned int mpc_flat_child(const mpc_flat_t *f, unsigned int i);
+unsigned int mpc_flat_next(const mpc_flat_t *f, unsigned int i);
+const char *mpc_flat_tag(const mpc_flat_t *f, unsigned int i);
+const char *mpc_flat_contents(const mpc_flat_t *f, unsigned int i);
+unsigned int mpc_flat_tag_id(const mpc_flat_t *f, const char *tag);
+
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **as);
 mpc_val_t *mpcf_str_ast(mpc_val_t *c);
 mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs);
@@ -299,7 +370,10 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4,
+  MPCA_LANG_LEXER                = 8,
+  MPCA_LANG_COLLAPSE             = 16
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -309,6 +383,16 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+struct mpc_grammar_t;
+typedef struct mpc_grammar_t mpc_grammar_t;
+
+mpc_err_t *mpca_lang_grammar(int flags, const char *language, mpc_grammar_t **g);
+mpc_parser_t *mpc_grammar_rule(const mpc_grammar_t *g, const char *name);
+void mpc_grammar_delete(mpc_grammar_t *g);
+
+int mpc_grammar_save(const mpc_grammar_t *g, char **blob, long *len);
+mpc_grammar_t *mpc_grammar_load(const char *blob, long len);
+
 /*
 ** Debug & Testing
 */
@@ -69,7 +69,240 @@ void test_maths(void) {
   mpc_cleanup(4, Expr, Factor, Term, Maths);
 }
 
+void test_borrowed(void) {
+  
+  mpc_parser_t *Digits = mpc_whole(mpc_digits(), free);
+  const char buffer[] = { '1', '2', '3', '4', 'x', 'y' };
+  mpc_result_t r;
+  
+  PT_ASSERT(mpc_parse_borrowed("<test>", buffer, 4, Digits, &r));
+  PT_ASSERT_STR_EQ(r.output, "1234");
+  free(r.output);
+  
+  PT_ASSERT(!mpc_parse_borrowed("<test>", buffer, 5, Digits, &r));
+  mpc_err_delete(r.error);
+  
+  PT_ASSERT(!mpc_parse_borrowed("<test>", buffer, 0, Digits, &r));
+  mpc_err_delete(r.error);
+  
+  mpc_delete(Digits);
+}
+
+void test_file(void) {
+  
+  mpc_parser_t *Digits = mpc_digits();
+  FILE *f = tmpfile();
+  mpc_result_t r;
+  
+  fputs("12 34", f);
+  fseek(f, 3, SEEK_SET);
+  
+  PT_ASSERT(mpc_parse_file("<test>", f, Digits, &r));
+  PT_ASSERT_STR_EQ(r.output, "34");
+  PT_ASSERT(ftell(f) == 5);
+  free(r.output);
+  
+  fclose(f);
+  mpc_delete(Digits);
+}
+
+void test_pipe(void) {
+  
+  mpc_parser_t *Words = mpc_whole(mpc_many1(mpcf_strfold, mpc_or(2,
+    mpc_string("abcX"), mpc_string("abcd"))), free);
+  FILE *f = tmpfile();
+  mpc_result_t r;
+  int k;
+  
+  for (k = 0; k < 1000; k++) { fputs("abcd", f); }
+  rewind(f);
+  
+  PT_ASSERT(mpc_parse_pipe("<test>", f, Words, &r));
+  PT_ASSERT(strlen(r.output) == 4000);
+  PT_ASSERT(strncmp(r.output, "abcdabcd", 8) == 0);
+  free(r.output);
+  
+  fclose(f);
+  mpc_delete(Words);
+}
+
+void test_errors(void) {
+  
+  mpc_parser_t *Words = mpc_whole(mpc_many1(mpcf_strfold, mpc_or(2,
+    mpc_expect(mpc_string("abcX"), "X word"), mpc_expect(mpc_string("abcd"), "d word"))), free);
+  const char *input = "abcdabcXabcY";
+  FILE *f = tmpfile();
+  mpc_result_t r0, r1;
+  char *e0, *e1;
+  
+  fputs(input, f);
+  rewind(f);
+  
+  /* Strings skip building errors until the parse fails, pipes never do */
+  PT_ASSERT(!mpc_parse("<test>", input, Words, &r0));
+  PT_ASSERT(!mpc_parse_pipe("<test>", f, Words, &r1));
+  e0 = mpc_err_string(r0.error);
+  e1 = mpc_err_string(r1.error);
+  PT_ASSERT_STR_EQ(e0, "<test>:1:9: error: expected X word, d word or end of input at 'a'\n");
+  PT_ASSERT_STR_EQ(e0, e1);
+  free(e0);
+  free(e1);
+  mpc_err_delete(r0.error);
+  mpc_err_delete(r1.error);
+  
+  fclose(f);
+  mpc_delete(Words);
+}
+
+void test_span(void) {
+  
+  mpc_parser_t *Sign = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  mpc_parser_t *Number = mpc_and(3, mpcf_strfold,
+    Sign, mpc_count(2, mpcf_strfold, mpc_digit(), free), mpc_many(mpcf_strfold, mpc_string("ab")),
+    free, free);
+  mpc_parser_t *Pair = mpc_and(2, mpcf_strfold,
+    Number, mpc_apply(mpc_many1(mpcf_strfold, mpc_alpha()), mpcf_escape), free);
+  
+  PT_ASSERT(mpc_test_pass(Number, "-12abab", "-12abab", string_eq, free, string_print));
+  PT_ASSERT(mpc_test_pass(Number, "34", "34", string_eq, free, string_print));
+  PT_ASSERT(mpc_test_pass(Number, "34a", "34", string_eq, free, string_print));
+  PT_ASSERT(mpc_test_fail(Number, "+1x", "", string_eq, free, string_print));
+  PT_ASSERT(mpc_test_pass(Pair, "12abxyz", "12abxyz", string_eq, free, string_print));
+  
+  mpc_delete(Pair);
+}
+
+void test_charset(void) {
+  
+  mpc_parser_t *Word = mpc_many1(mpcf_strfold, mpc_or(3,
+    mpc_range('a', 'f'), mpc_oneof("xyz_"), mpc_range('\x80', '\xff')));
+  mpc_parser_t *Other = mpc_many1(mpcf_strfold, mpc_noneof(" \t\nabc"));
+  mpc_parser_t *Space = mpc_many1(mpcf_strfold, mpc_whitespace());
+  
+  PT_ASSERT(mpc_test_pass(Word, "fax_\xc3\xa9g", "fax_\xc3\xa9", string_eq, free, string_print));
+  PT_ASSERT(mpc_test_fail(Word, "g", "", string_eq, free, string_print));
+  PT_ASSERT(mpc_test_pass(Other, "xy-z\xff" "a", "xy-z\xff", string_eq, free, string_print));
+  PT_ASSERT(mpc_test_fail(Other, "\tz", "", string_eq, free, string_print));
+  PT_ASSERT(mpc_test_pass(Space, " \t\v\r\n.", " \t\v\r\n", string_eq, free, string_print));
+  
+  mpc_delete(Word);
+  mpc_delete(Other);
+  mpc_delete(Space);
+}
+
+void test_run(void) {
+  
+  int k;
+  char text[200];
+  mpc_result_t r;
+  mpc_state_t *t;
+  mpc_parser_t *Word = mpc_class_run("abcdefghijklmnopqrstuvwxyz_0123456789");
+  mpc_parser_t *Odd = mpc_class_run("acegikmoq");
+  mpc_parser_t *Skip = mpc_and(2, mpcf_snd_free, mpc_blank_run(), mpc_state(), free);
+  
+  for (k = 0; k < 150; k++) { text[k] = "hello_world42"[k % 13]; }
+  strcpy(text + 150, "+x");
+  PT_ASSERT(mpc_parse("<test>", text, Word, &r));
+  PT_ASSERT(strlen(r.output) == 150);
+  free(r.output);
+  
+  PT_ASSERT(mpc_test_pass(Word, "+x", "", string_eq, free, string_print));
+  PT_ASSERT(mpc_test_pass(Odd, "acegikmoqacegikmoqacegikmoqacegikmoqb", "acegikmoqacegikmoqacegikmoqacegikmoq", string_eq, free, string_print));
+  
+  for (k = 0; k < 150; k++) { text[k] = k % 37 == 0 ? '\n' : k % 2 ? ' ' : '\t'; }
+  strcpy(text + 150, "x");
+  PT_ASSERT(mpc_parse("<test>", text, Skip, &r));
+  t = r.output;
+  PT_ASSERT(t->pos == 150 && t->row == 5 && t->col == 1);
+  free(t);
+  
+  mpc_delete(Word);
+  mpc_delete(Odd);
+  mpc_delete(Skip);
+}
+
+static mpc_val_t *fold_binop(int n, mpc_val_t **xs) {
+  int *x = xs[0], y = *(int*)xs[2], k;
+  (void) n;
+  switch (((char*)xs[1])[0]) {
+    case '+': *x += y; break;
+    case '-': *x -= y; break;
+    case '*': *x *= y; break;
+    case '^': for (k = *x, *x = 1; y > 0; y--) { *x *= k; } break;
+    default: break;
+  }
+  free(xs[1]);
+  free(xs[2]);
+  return x;
+}
+
+void test_expr(void) {
+  
+  static const mpc_op_t ops[] = {
+    { "+", 1, MPC_ASSOC_LEFT,  fold_binop },
+    { "-", 1, MPC_ASSOC_LEFT,  fold_binop },
+    { "*", 2, MPC_ASSOC_LEFT,  fold_binop },
+    { "^", 3, MPC_ASSOC_RIGHT, fold_binop },
+    { NULL, 0, 0, NULL }
+  };
+  
+  int r0 = 7, r1 = -5, r2 = 512, r3 = 10, r4 = 3, r5 = 42;
+  mpc_parser_t *Expr = mpc_expr(mpc_tok(mpc_int()), ops);
+  
+  PT_ASSERT(mpc_test_pass(Expr, "1 + 2 * 3", &r0, int_eq, free, int_print));
+  PT_ASSERT(mpc_test_pass(Expr, "2 - 3 - 4", &r1, int_eq, free, int_print));
+  PT_ASSERT(mpc_test_pass(Expr, "2 ^ 3 ^ 2", &r2, int_eq, free, int_print));
+  PT_ASSERT(mpc_test_pass(Expr, "2*3+4", &r3, int_eq, free, int_print));
+  PT_ASSERT(mpc_test_pass(Expr, "1 + 2 +", &r4, int_eq, free, int_print));
+  PT_ASSERT(mpc_test_pass(Expr, "42", &r5, int_eq, free, int_print));
+  PT_ASSERT(mpc_test_fail(Expr, "+ 1", &r5, int_eq, free, int_print));
+  
+  mpc_delete(Expr);
+}
+
+void test_cut(void) {
+  
+  mpc_parser_t *Let = mpc_and(2, mpcf_strfold,
+    mpc_string("let "), mpc_and(2, mpcf_snd, mpc_cut(), mpc_string("x;"), free), free);
+  mpc_parser_t *Stmts = mpc_whole(mpc_many1(mpcf_strfold,
+    mpc_or(2, Let, mpc_string("let y;"))), free);
+  FILE *f = tmpfile();
+  mpc_result_t r;
+  char *e;
+  int k;
+  
+  PT_ASSERT(mpc_parse("<test>", "let x;let x;", Stmts, &r));
+  PT_ASSERT_STR_EQ(r.output, "let x;let x;");
+  free(r.output);
+  
+  /* Once past "let " the second alternative is never tried */
+  PT_ASSERT(!mpc_parse("<test>", "let x;let y;", Stmts, &r));
+  e = mpc_err_string(r.error);
+  PT_ASSERT_STR_EQ(e, "<test>:1:11: error: expected \"x;\" at 'y'\n");
+  mpc_err_delete(r.error);
+  free(e);
+  
+  for (k = 0; k < 1000; k++) { fputs("let x;", f); }
+  rewind(f);
+  
+  PT_ASSERT(mpc_parse_pipe("<test>", f, Stmts, &r));
+  PT_ASSERT(strlen(r.output) == 6000);
+  free(r.output);
+  
+  fclose(f);
+  mpc_delete(Stmts);
+}
+
 void suite_core(void) {
   pt_add_test(test_ident, "Test Ident", "Suite Core");
   pt_add_test(test_maths, "Test Maths", "Suite Core");
+  pt_add_test(test_borrowed, "Test Borrowed", "Suite Core");
+  pt_add_test(test_file, "Test File", "Suite Core");
+  pt_add_test(test_pipe, "Test Pipe", "Suite Core");
+  pt_add_test(test_errors, "Test Errors", "Suite Core");
+  pt_add_test(test_span, "Test Span", "Suite Core");
+  pt_add_test(test_charset, "Test Charset", "Suite Core");
+  pt_add_test(test_run, "Test Run", "Suite Core");
+  pt_add_test(test_expr, "Test Expr", "Suite Core");
+  pt_add_test(test_cut, "Test Cut", "Suite Core");
 }
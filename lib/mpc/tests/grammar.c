@@ -1,6 +1,8 @@
 #include "ptest.h"
 #include "../mpc.h"
 
+#include <string.h>
+
 void test_grammar(void) {
 
   mpc_parser_t *Expr, *Prod, *Value, *Maths;
@@ -91,8 +93,553 @@ void test_language_file(void) {
   
 }
 
+void test_interned_tags(void) {
+  
+  mpc_parser_t *Expr, *Prod, *Value, *Maths;
+  mpc_result_t r;
+  mpc_ast_t *a;
+  
+  Expr  = mpc_new("expression");
+  Prod  = mpc_new("product");
+  Value = mpc_new("value");
+  Maths = mpc_new("maths");
+  
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " expression : <product> (('+' | '-') <product>)*; "
+    " product : <value>   (('*' | '/')   <value>)*;    "
+    " value : /[0-9]+/ | '(' <expression> ')';         "
+    " maths : /^/ <expression> /$/;                    ",
+    Expr, Prod, Value, Maths);
+  
+  PT_ASSERT(mpc_intern("value|regex") == mpc_intern("value|regex"));
+  
+  PT_ASSERT(mpc_parse("<test>", "1 + 2*3", Maths, &r));
+  a = r.output;
+  a = a->children[1];
+  PT_ASSERT(a->tag == mpc_intern("expression|>"));
+  PT_ASSERT(a->children[0]->tag == mpc_intern("product|value|regex"));
+  PT_ASSERT(a->children[2]->tag == mpc_intern("product|>"));
+  PT_ASSERT(a->children[2]->children[0]->tag == mpc_intern("value|regex"));
+  PT_ASSERT_STR_EQ(a->children[2]->children[2]->contents, "3");
+  mpc_ast_delete(r.output);
+  
+  mpc_cleanup(4, Expr, Prod, Value, Maths);
+  
+  /* Once nothing uses them the tags can all be freed */
+  mpc_intern_cleanup();
+  PT_ASSERT_STR_EQ(mpc_intern("value|regex"), "value|regex");
+  PT_ASSERT(mpc_intern("value|regex") == mpc_intern("value|regex"));
+}
+
+void test_arena(void) {
+  
+  mpc_parser_t *Expr, *Prod, *Value, *Maths;
+  mpc_arena_t *arena;
+  mpc_result_t r0, r1;
+  const char *input = "(4 * 2 * 11 + 2) + 5 * (3 - 1)";
+  int k;
+  
+  Expr  = mpc_new("expression");
+  Prod  = mpc_new("product");
+  Value = mpc_new("value");
+  Maths = mpc_new("maths");
+  
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " expression : <product> (('+' | '-') <product>)*; "
+    " product : <value>   (('*' | '/')   <value>)*;    "
+    " value : /[0-9]+/ | '(' <expression> ')';         "
+    " maths : /^/ <expression> /$/;                    ",
+    Expr, Prod, Value, Maths);
+  
+  PT_ASSERT(mpc_parse("<test>", input, Maths, &r0));
+  
+  arena = mpc_arena_new();
+  for (k = 0; k < 100; k++) {
+    PT_ASSERT(mpc_parse_arena("<test>", input, strlen(input), arena, Maths, &r1));
+  }
+  PT_ASSERT(mpc_ast_eq(r0.output, r1.output));
+  
+  PT_ASSERT(!mpc_parse_arena("<test>", "2b+4", 4, arena, Maths, &r1));
+  mpc_err_delete(r1.error);
+  
+  mpc_arena_free(arena);
+  mpc_ast_delete(r0.output);
+  
+  mpc_cleanup(4, Expr, Prod, Value, Maths);
+}
+
+static int flat_eq(mpc_flat_t *f, unsigned int i, mpc_ast_t *a) {
+  
+  int k;
+  unsigned int c;
+  
+  if (strcmp(mpc_flat_tag(f, i), a->tag) != 0) { return 0; }
+  if (strcmp(mpc_flat_contents(f, i), a->contents) != 0) { return 0; }
+  if (mpc_flat_node(f, i)->state.pos != a->state.pos) { return 0; }
+  
+  for (k = 0, c = mpc_flat_child(f, i); k < a->children_num; k++, c = mpc_flat_next(f, c)) {
+    if (c == MPC_FLAT_NONE) { return 0; }
+    if (mpc_flat_node(f, c)->parent != i) { return 0; }
+    if (!flat_eq(f, c, a->children[k])) { return 0; }
+  }
+  
+  return c == MPC_FLAT_NONE;
+}
+
+void test_flat(void) {
+  
+  mpc_parser_t *Expr, *Prod, *Value, *Maths;
+  mpc_result_t r;
+  mpc_flat_t *f, *g;
+  unsigned int i, regex, n = 0;
+  
+  Expr  = mpc_new("expression");
+  Prod  = mpc_new("product");
+  Value = mpc_new("value");
+  Maths = mpc_new("maths");
+  
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " expression : <product> (('+' | '-') <product>)*; "
+    " product : <value>   (('*' | '/')   <value>)*;    "
+    " value : /[0-9]+/ | '(' <expression> ')';         "
+    " maths : /^/ <expression> /$/;                    ",
+    Expr, Prod, Value, Maths);
+  
+  PT_ASSERT(mpc_parse("<test>", "(4 * 2 * 11 + 2) + 5", Maths, &r));
+  f = mpc_ast_flatten(r.output);
+  PT_ASSERT(flat_eq(f, 0, r.output));
+  PT_ASSERT(mpc_flat_next(f, 0) == MPC_FLAT_NONE);
+  mpc_ast_delete(r.output);
+  
+  g = mpc_flat_copy(f);
+  mpc_flat_delete(f);
+  
+  regex = mpc_flat_tag_id(g, "value|regex");
+  PT_ASSERT(regex != MPC_FLAT_NONE);
+  PT_ASSERT(mpc_flat_tag_id(g, "no such tag") == MPC_FLAT_NONE);
+  for (i = 0; i < g->nodes_num; i++) {
+    if (mpc_flat_node(g, i)->tag == regex) { n++; }
+  }
+  PT_ASSERT(n == 3);
+  PT_ASSERT_STR_EQ(mpc_flat_contents(g, 4), "(");
+  
+  mpc_flat_delete(g);
+  mpc_cleanup(4, Expr, Prod, Value, Maths);
+}
+
+void test_packrat(void) {
+  
+  mpc_parser_t *Expr, *Prod, *Value, *Ident, *Call, *Index, *Maths;
+  mpc_parser_t *ps[7];
+  mpc_result_t r0, r1;
+  char *e0, *e1;
+  int k, flags;
+  const char *good = "f(a[1] + 2, b) * (c + g(d[e[3]]))";
+  const char *bad  = "f(a[1] + 2, b) * (c + g(d[e[3)))";
+  
+  for (k = 0; k < 2; k++) {
+    
+    Expr  = mpc_new("expression");
+    Prod  = mpc_new("product");
+    Value = mpc_new("value");
+    Ident = mpc_new("ident");
+    Call  = mpc_new("call");
+    Index = mpc_new("index");
+    Maths = mpc_new("maths");
+    
+    flags = k ? MPCA_LANG_PACKRAT : MPCA_LANG_DEFAULT;
+    PT_ASSERT(mpca_lang(flags,
+      " expression : <product> (('+' | '-') <product>)*;             "
+      " product : <value> (('*' | '/') <value>)*;                    "
+      " ident : /[a-z]+/ ;                                           "
+      " call : <ident> '(' <expression> (',' <expression>)* ')' ;    "
+      " index : <ident> '[' <expression> ']' ;                       "
+      " value : /[0-9]+/ | '(' <expression> ')' | <call> | <index> | <ident> ; "
+      " maths : /^/ <expression> /$/;                                ",
+      Expr, Prod, Value, Ident, Call, Index, Maths, NULL) == NULL);
+    
+    if (k == 0) {
+      PT_ASSERT(mpc_parse("<test>", good, Maths, &r0));
+      PT_ASSERT(!mpc_parse("<test>", bad, Maths, &r1));
+      e0 = mpc_err_string(r1.error);
+      mpc_err_delete(r1.error);
+      ps[0] = Expr; ps[1] = Prod; ps[2] = Value; ps[3] = Ident;
+      ps[4] = Call; ps[5] = Index; ps[6] = Maths;
+    } else {
+      PT_ASSERT(mpc_parse("<test>", good, Maths, &r1));
+      PT_ASSERT(mpc_ast_eq(r0.output, r1.output));
+      mpc_ast_delete(r1.output);
+      PT_ASSERT(!mpc_parse("<test>", bad, Maths, &r1));
+      e1 = mpc_err_string(r1.error);
+      PT_ASSERT_STR_EQ(e0, e1);
+      mpc_err_delete(r1.error);
+      free(e1);
+      mpc_cleanup(7, Expr, Prod, Value, Ident, Call, Index, Maths);
+    }
+  }
+  
+  mpc_ast_delete(r0.output);
+  free(e0);
+  mpc_cleanup(7, ps[0], ps[1], ps[2], ps[3], ps[4], ps[5], ps[6]);
+}
+
+void test_lexer(void) {
+  
+  mpc_parser_t *Stmt, *Expr, *Ident, *Prog;
+  mpc_parser_t *ps[4];
+  mpc_result_t r0, r1;
+  int k;
+  const char *good = "if x then 12 iffy <- 3.5 ifx<-y";
+  
+  for (k = 0; k < 2; k++) {
+    
+    Stmt  = mpc_new("stmt");
+    Expr  = mpc_new("expr");
+    Ident = mpc_new("ident");
+    Prog  = mpc_new("prog");
+    
+    PT_ASSERT(mpca_lang(k ? MPCA_LANG_LEXER : MPCA_LANG_DEFAULT,
+      " stmt : \"if\" <expr> \"then\" <expr> | <ident> /<-/ <expr> ; "
+      " expr : /[0-9]+\\.[0-9]+/ | /[0-9]+/ | <ident> ;           "
+      " ident : /[a-z]+/ ;                                        "
+      " prog : /^/ <stmt>+ /$/ ;                                  ",
+      Stmt, Expr, Ident, Prog, NULL) == NULL);
+    
+    if (k == 0) {
+      PT_ASSERT(mpc_parse("<test>", good, Prog, &r0));
+      PT_ASSERT(mpc_parse("<test>", "if <- 1", Prog, &r1));
+      mpc_ast_delete(r1.output);
+      ps[0] = Stmt; ps[1] = Expr; ps[2] = Ident; ps[3] = Prog;
+    } else {
+      PT_ASSERT(mpc_parse("<test>", good, Prog, &r1));
+      PT_ASSERT(mpc_ast_eq(r0.output, r1.output));
+      mpc_ast_delete(r1.output);
+      
+      /* The keyword wins over an identifier of the same length */
+      PT_ASSERT(!mpc_parse("<test>", "if <- 1", Prog, &r1));
+      PT_ASSERT(r1.error->state.pos == 3);
+      mpc_err_delete(r1.error);
+      mpc_cleanup(4, Stmt, Expr, Ident, Prog);
+    }
+  }
+  
+  mpc_ast_delete(r0.output);
+  mpc_cleanup(4, ps[0], ps[1], ps[2], ps[3]);
+}
+
+void test_lexer_keywords(void) {
+  
+  mpc_parser_t *Decl, *Var, *Prog;
+  mpc_result_t r;
+  const char *glued[] = { "PARAMETERSl1;", "BEGINEND;", "PARAMETERS a; BEGINEND;" };
+  int k, j;
+  char *e;
+  
+  for (k = 0; k < 2; k++) {
+    
+    Decl = mpc_new("decl");
+    Var  = mpc_new("var");
+    Prog = mpc_new("prog");
+    
+    PT_ASSERT(mpca_lang(k ? MPCA_LANG_LEXER : MPCA_LANG_DEFAULT,
+      " decl : \"PARAMETERS\" <var> ';' | \"BEGIN\" \"END\" ';' ; "
+      " var : /[A-Za-z][A-Za-z0-9]*/ ;                            "
+      " prog : /^/ <decl>+ /$/ ;                                  ",
+      Decl, Var, Prog, NULL) == NULL);
+    
+    PT_ASSERT(mpc_parse("<test>", "PARAMETERS l1; BEGIN END;", Prog, &r));
+    mpc_ast_delete(r.output);
+    
+    /* Without the lexer a keyword may run straight into the next word */
+    for (j = 0; j < 3; j++) {
+      if (k == 0) {
+        PT_ASSERT(mpc_parse("<test>", glued[j], Prog, &r));
+        mpc_ast_delete(r.output);
+      } else {
+        PT_ASSERT(!mpc_parse("<test>", glued[j], Prog, &r));
+        PT_ASSERT(r.error->state.pos == (j == 2 ? 14 : 0));
+        mpc_err_delete(r.error);
+      }
+    }
+    
+    /* The error names the token that was found instead */
+    if (k == 1) {
+      PT_ASSERT(!mpc_parse("<test>", "PARAMETERSl1;", Prog, &r));
+      e = mpc_err_string(r.error);
+      PT_ASSERT_STR_EQ(e, "<test>:1:1: error: expected whitespace or one or more of "
+        "\"PARAMETERS\" (found token 'PARAMETERSl1') or \"BEGIN\" at 'P'\n");
+      mpc_err_delete(r.error);
+      free(e);
+    }
+    
+    mpc_cleanup(3, Decl, Var, Prog);
+  }
+}
+
+void test_first(void) {
+  
+  mpc_parser_t *Expr, *Prod, *Value, *Maths;
+  mpc_result_t r;
+  char *e;
+  
+  Expr  = mpc_new("expression");
+  Prod  = mpc_new("product");
+  Value = mpc_new("value");
+  Maths = mpc_new("maths");
+  
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " expression : <product> (('+' | '-') <product>)*; "
+    " product : <value>   (('*' | '/')   <value>)*;    "
+    " value : /[0-9]+/ | '(' <expression> ')' | 'x';   "
+    " maths : /^/ <expression> /$/;                    ",
+    Expr, Prod, Value, Maths);
+  
+  PT_ASSERT(mpc_parse("<test>", "(x + 2) * x", Maths, &r));
+  mpc_ast_delete(r.output);
+  
+  /* Pruned alternatives still show up in the error */
+  PT_ASSERT(!mpc_parse("<test>", "(x + 2) * y", Maths, &r));
+  e = mpc_err_string(r.error);
+  PT_ASSERT_STR_EQ(e, "<test>:1:11: error: expected whitespace, one or more of one of '0123456789', '(' or 'x' at 'y'\n");
+  free(e);
+  mpc_err_delete(r.error);
+  
+  mpc_cleanup(4, Expr, Prod, Value, Maths);
+}
+
+void test_expr_grammar(void) {
+  
+  mpc_parser_t *Expr, *Value, *Maths;
+  mpc_ast_t *t0, *t1;
+  
+  Expr  = mpc_new("expression");
+  Value = mpc_new("value");
+  Maths = mpc_new("maths");
+  
+  PT_ASSERT(mpca_lang(MPCA_LANG_DEFAULT,
+    " expression : <value> %left '+' '-' %left '*' %right '^' ; "
+    " value : /[0-9]+/ | '(' <expression> ')' ;                 "
+    " maths : /^/ <expression> /$/ ;                            ",
+    Expr, Value, Maths, NULL) == NULL);
+  
+  t0 = mpc_ast_build(3, ">",
+    mpc_ast_new("regex", ""),
+    mpc_ast_build(3, "expression|binop|>",
+      mpc_ast_new("value|regex", "1"),
+      mpc_ast_new("char", "+"),
+      mpc_ast_build(3, "binop|>",
+        mpc_ast_new("value|regex", "2"),
+        mpc_ast_new("char", "*"),
+        mpc_ast_new("value|regex", "3"))),
+    mpc_ast_new("regex", ""));
+  
+  t1 = mpc_ast_build(3, ">",
+    mpc_ast_new("regex", ""),
+    mpc_ast_build(3, "expression|binop|>",
+      mpc_ast_build(3, "binop|>",
+        mpc_ast_new("value|regex", "2"),
+        mpc_ast_new("char", "^"),
+        mpc_ast_build(3, "binop|>",
+          mpc_ast_new("value|regex", "3"),
+          mpc_ast_new("char", "^"),
+          mpc_ast_new("value|regex", "4"))),
+      mpc_ast_new("char", "-"),
+      mpc_ast_new("value|regex", "1")),
+    mpc_ast_new("regex", ""));
+  
+  PT_ASSERT(mpc_test_pass(Maths, "1 + 2 * 3", t0, (int(*)(const void*,const void*))mpc_ast_eq, (mpc_dtor_t)mpc_ast_delete, (void(*)(const void*))mpc_ast_print));
+  PT_ASSERT(mpc_test_pass(Maths, "2^3^4 - 1", t1, (int(*)(const void*,const void*))mpc_ast_eq, (mpc_dtor_t)mpc_ast_delete, (void(*)(const void*))mpc_ast_print));
+  PT_ASSERT(mpc_test_fail(Maths, "1 + * 2", t0, (int(*)(const void*,const void*))mpc_ast_eq, (mpc_dtor_t)mpc_ast_delete, (void(*)(const void*))mpc_ast_print));
+  
+  mpc_ast_delete(t0);
+  mpc_ast_delete(t1);
+  
+  mpc_cleanup(3, Expr, Value, Maths);
+}
+
+void test_collapse(void) {
+  
+  mpc_parser_t *Expr, *Prod, *Value, *Maths;
+  mpc_ast_t *t0, *t1;
+  
+  Expr  = mpc_new("expression");
+  Prod  = mpc_new("product");
+  Value = mpc_new("value");
+  Maths = mpc_new("maths");
+  
+  PT_ASSERT(mpca_lang(MPCA_LANG_COLLAPSE,
+    " expression : <product> (('+' | '-') <product>)* ; "
+    " product : <value> (('*' | '/') <value>)* ;       "
+    " value : /[0-9]+/ | '(' <expression> ')' ;        "
+    " maths : /^/ <expression> /$/ ;                   ",
+    Expr, Prod, Value, Maths, NULL) == NULL);
+  
+  t0 = mpc_ast_build(3, ">",
+    mpc_ast_new("regex", ""),
+    mpc_ast_build(3, "expression|product|>",
+      mpc_ast_build(3, "value|expression|>",
+        mpc_ast_new("product|value|regex", "1"),
+        mpc_ast_new("char", "+"),
+        mpc_ast_new("product|value|regex", "2")),
+      mpc_ast_new("char", "*"),
+      mpc_ast_new("value|regex", "3")),
+    mpc_ast_new("regex", ""));
+  
+  t1 = mpc_ast_build(3, ">",
+    mpc_ast_new("regex", ""),
+    mpc_ast_new("expression|product|value|expression|product|value|regex", "4"),
+    mpc_ast_new("regex", ""));
+  
+  PT_ASSERT(mpc_test_pass(Maths, "(1 + 2) * 3", t0, (int(*)(const void*,const void*))mpc_ast_eq, (mpc_dtor_t)mpc_ast_delete, (void(*)(const void*))mpc_ast_print));
+  PT_ASSERT(mpc_test_pass(Maths, "(4)", t1, (int(*)(const void*,const void*))mpc_ast_eq, (mpc_dtor_t)mpc_ast_delete, (void(*)(const void*))mpc_ast_print));
+  PT_ASSERT(mpc_test_fail(Maths, "(4", t1, (int(*)(const void*,const void*))mpc_ast_eq, (mpc_dtor_t)mpc_ast_delete, (void(*)(const void*))mpc_ast_print));
+  
+  mpc_ast_delete(t0);
+  mpc_ast_delete(t1);
+  
+  mpc_cleanup(4, Expr, Prod, Value, Maths);
+}
+
+void test_lang_unknown(void) {
+  
+  mpc_parser_t *A, *Top;
+  mpc_result_t r;
+  
+  A   = mpc_new("a");
+  Top = mpc_new("top");
+  
+  /* `b` isn't passed in, which only fails if that branch is tried */
+  PT_ASSERT(mpca_lang(MPCA_LANG_DEFAULT,
+    " a : <b> | 'z' ; top : /^/ <a> /$/ ; ",
+    A, Top, NULL) == NULL);
+  
+  PT_ASSERT(mpc_parse("<test>", "z", Top, &r));
+  mpc_ast_delete(r.output);
+  PT_ASSERT(!mpc_parse("<test>", "y", Top, &r));
+  mpc_err_delete(r.error);
+  
+  mpc_cleanup(2, A, Top);
+}
+
+void test_lang_grammar(void) {
+  
+  mpc_grammar_t *g;
+  mpc_err_t *e;
+  char *m;
+  mpc_parser_t *Maths;
+  mpc_ast_t *t0;
+  
+  e = mpca_lang_grammar(MPCA_LANG_DEFAULT,
+    " maths : /^/ <number> ('+' <number>)* /$/ ; "
+    " number : /[0-9]+/ ;                        ",
+    &g);
+  PT_ASSERT(e == NULL);
+  
+  Maths = mpc_grammar_rule(g, "maths");
+  PT_ASSERT(Maths != NULL);
+  PT_ASSERT(mpc_grammar_rule(g, "number") != NULL);
+  PT_ASSERT(mpc_grammar_rule(g, "product") == NULL);
+  
+  t0 = mpc_ast_build(5, ">",
+    mpc_ast_new("regex", ""),
+    mpc_ast_new("number|regex", "1"),
+    mpc_ast_new("char", "+"),
+    mpc_ast_new("number|regex", "2"),
+    mpc_ast_new("regex", ""));
+  
+  PT_ASSERT(mpc_test_pass(Maths, "1+2", t0, (int(*)(const void*,const void*))mpc_ast_eq, (mpc_dtor_t)mpc_ast_delete, (void(*)(const void*))mpc_ast_print));
+  PT_ASSERT(mpc_test_fail(Maths, "1+", t0, (int(*)(const void*,const void*))mpc_ast_eq, (mpc_dtor_t)mpc_ast_delete, (void(*)(const void*))mpc_ast_print));
+  
+  mpc_ast_delete(t0);
+  mpc_grammar_delete(g);
+  
+  /* Every rule used has to be defined */
+  e = mpca_lang_grammar(MPCA_LANG_DEFAULT, " maths : <number> ('+' <number>)* ; ", &g);
+  PT_ASSERT(e != NULL && g == NULL);
+  m = mpc_err_string(e);
+  PT_ASSERT_STR_EQ(m, "<mpca_lang_grammar>: error: Rule 'number' is never defined!\n");
+  free(m);
+  mpc_err_delete(e);
+}
+
+void test_grammar_save(void) {
+  
+  int i, j, flags[2];
+  long len;
+  char *blob, *m0, *m1;
+  mpc_grammar_t *g0, *g1;
+  mpc_result_t r0, r1;
+  
+  const char *inputs[] = {
+    "let x = 1 + 2 * (y - 3);", "let x = 2 ^ 3 ^ 4;",
+    "let x = \"a\\\"b\" + 'c';", "let = 1;", "let x = 1 +;", "", NULL };
+  
+  flags[0] = MPCA_LANG_DEFAULT;
+  flags[1] = MPCA_LANG_LEXER | MPCA_LANG_PACKRAT | MPCA_LANG_COLLAPSE;
+  
+  for (i = 0; i < 2; i++) {
+    
+    PT_ASSERT(mpca_lang_grammar(flags[i],
+      " prog  : /^/ <stmt>* /$/ ;                                   "
+      " stmt  : \"let\" ^ <ident> '=' <expr> ';' ;                  "
+      " expr  : <value> %left '+' '-' %left '*' %right '^' ;        "
+      " value : /[0-9]+\\b/ | <ident> | <string> | <char>          "
+      "       | '(' <expr> ')' ;                                    "
+      " ident : /[a-z]+/ ;                                          "
+      " string : /\"(\\\\.|[^\"])*\"/ ;                               "
+      " char  : /'.'/ ;                                             ",
+      &g0) == NULL);
+    
+    PT_ASSERT(mpc_grammar_save(g0, &blob, &len));
+    g1 = mpc_grammar_load(blob, len);
+    PT_ASSERT(g1 != NULL);
+    
+    for (j = 0; inputs[j]; j++) {
+      
+      if (mpc_parse("<test>", inputs[j], mpc_grammar_rule(g0, "prog"), &r0)
+      &&  mpc_parse("<test>", inputs[j], mpc_grammar_rule(g1, "prog"), &r1)) {
+        PT_ASSERT(mpc_ast_eq(r0.output, r1.output));
+        mpc_ast_delete(r0.output);
+        mpc_ast_delete(r1.output);
+        continue;
+      }
+      
+      PT_ASSERT(!mpc_parse("<test>", inputs[j], mpc_grammar_rule(g1, "prog"), &r1));
+      m0 = mpc_err_string(r0.error);
+      m1 = mpc_err_string(r1.error);
+      PT_ASSERT_STR_EQ(m0, m1);
+      free(m0);
+      free(m1);
+      mpc_err_delete(r0.error);
+      mpc_err_delete(r1.error);
+    }
+    
+    /* Cut short or damaged blobs are turned down */
+    for (j = 0; j < len; j++) { PT_ASSERT(mpc_grammar_load(blob, j) == NULL); }
+    blob[4]++;
+    PT_ASSERT(mpc_grammar_load(blob, len) == NULL);
+    
+    free(blob);
+    mpc_grammar_delete(g0);
+    mpc_grammar_delete(g1);
+  }
+  
+}
+
 void suite_grammar(void) {
   pt_add_test(test_grammar, "Test Grammar", "Suite Grammar");
   pt_add_test(test_language, "Test Language", "Suite Grammar");
   pt_add_test(test_language_file, "Test Language File", "Suite Grammar");
+  pt_add_test(test_interned_tags, "Test Interned Tags", "Suite Grammar");
+  pt_add_test(test_arena, "Test Arena", "Suite Grammar");
+  pt_add_test(test_flat, "Test Flat", "Suite Grammar");
+  pt_add_test(test_packrat, "Test Packrat", "Suite Grammar");
+  pt_add_test(test_first, "Test First", "Suite Grammar");
+  pt_add_test(test_lexer, "Test Lexer", "Suite Grammar");
+  pt_add_test(test_lexer_keywords, "Test Lexer Keywords", "Suite Grammar");
+  pt_add_test(test_expr_grammar, "Test Expr Grammar", "Suite Grammar");
+  pt_add_test(test_collapse, "Test Collapse", "Suite Grammar");
+  pt_add_test(test_lang_unknown, "Test Lang Unknown", "Suite Grammar");
+  pt_add_test(test_lang_grammar, "Test Lang Grammar", "Suite Grammar");
+  pt_add_test(test_grammar_save, "Test Grammar Save", "Suite Grammar");
 }
@@ -120,10 +120,40 @@ void test_regex_lisp_comment(void) {
   
 }
 
+void test_regex_dfa(void) {
+
+  mpc_parser_t *re0, *re1, *re2, *re3;
+
+  re0 = mpc_re("[a-zA-Z_][a-zA-Z0-9_]*");
+  re1 = mpc_re("[a-zA-Z_][a-zA-Z0-9_]*");
+  re2 = mpc_re("-?[0-9]+(\\.[0-9]*)?");
+  re3 = mpc_re("ab{2}c?");
+
+  PT_ASSERT(regex_test_pass(re0, "foo_1 bar", "foo_1"));
+  PT_ASSERT(regex_test_fail(re0, "1foo", ""));
+  PT_ASSERT(regex_test_pass(re2, "-12.5x", "-12.5"));
+  PT_ASSERT(regex_test_pass(re2, "7.", "7."));
+  PT_ASSERT(regex_test_fail(re2, "-x", ""));
+  PT_ASSERT(regex_test_pass(re3, "abbc", "abbc"));
+  PT_ASSERT(regex_test_pass(re3, "abb", "abb"));
+  PT_ASSERT(regex_test_fail(re3, "abbbc", ""));
+  PT_ASSERT(regex_test_fail(re3, "ab", ""));
+
+  /* Identical patterns share one automaton */
+  mpc_delete(re0);
+  PT_ASSERT(regex_test_pass(re1, "_x9", "_x9"));
+
+  mpc_delete(re1);
+  mpc_delete(re2);
+  mpc_delete(re3);
+
+}
+
 void suite_regex(void) {
   pt_add_test(test_regex_basic, "Test Regex Basic", "Suite Regex");
   pt_add_test(test_regex_range, "Test Regex Range", "Suite Regex");
   pt_add_test(test_regex_string, "Test Regex String", "Suite Regex");
   pt_add_test(test_regex_lisp_comment, "Test Regex Lisp Comment", "Suite Regex");
   pt_add_test(test_regex_boundary, "Test Regex Boundary", "Suite Regex");
+  pt_add_test(test_regex_dfa, "Test Regex DFA", "Suite Regex");
 }
@@ -0,0 +1,138 @@
+#if !defined(_POSIX_C_SOURCE) && (defined(__unix__) || defined(__APPLE__))
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "ptest.h"
+#include "../mpc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <pthread.h>
+
+enum { THREADS = 8, ROUNDS = 200 };
+
+static const char *inputs[] = {
+  "f(a[1] + 2, b) * (c + g(d[e[3]]))",
+  "(1 + 2) * 3 - x[y[z]] / h(4)",
+  "f(a[1] + 2, b) * (c + g(d[e[3)))",
+  "1 + + 2"
+};
+
+typedef struct {
+  int id;
+  mpc_parser_t *maths;
+  mpc_ast_t *asts[4];
+  char *errs[4];
+  int failures;
+} stress_t;
+
+/* Every thread parses every input over and over with one context */
+static void *stress_run(void *x) {
+  
+  stress_t *s = x;
+  mpc_context_t *c = mpc_context_new();
+  mpc_arena_t *a;
+  mpc_result_t r;
+  char *e, tag[32];
+  int k, j, ok;
+  
+  for (k = 0; k < ROUNDS; k++) {
+    
+    /* New tags grow the intern table while others read it */
+    sprintf(tag, "stress_%i_%i", s->id, k);
+    if (strcmp(mpc_intern(tag), tag) != 0) { s->failures++; }
+    
+    for (j = 0; j < 4; j++) {
+      
+      a = (k % 2) ? mpc_arena_new() : NULL;
+      ok = mpc_parse_context("<test>", inputs[j], strlen(inputs[j]), c, a, s->maths, &r);
+      
+      if (ok != (s->asts[j] != NULL)) {
+        s->failures++;
+        if (ok) { mpc_ast_delete(r.output); } else { mpc_err_delete(r.error); }
+      } else if (ok) {
+        if (!mpc_ast_eq(r.output, s->asts[j])) { s->failures++; }
+        if (!a) { mpc_ast_delete(r.output); }
+      } else {
+        e = mpc_err_string(r.error);
+        if (strcmp(e, s->errs[j]) != 0) { s->failures++; }
+        mpc_err_delete(r.error);
+        free(e);
+      }
+      
+      if (a) { mpc_arena_free(a); }
+    }
+  }
+  
+  mpc_context_delete(c);
+  return NULL;
+}
+
+void test_threads(void) {
+  
+  mpc_grammar_t *g;
+  mpc_result_t r;
+  pthread_t ts[THREADS];
+  stress_t ss[THREADS];
+  stress_t s;
+  int k, j;
+  
+  PT_ASSERT(mpca_lang_grammar(MPCA_LANG_PACKRAT | MPCA_LANG_LEXER,
+    " expression : <product> (('+' | '-') <product>)*;             "
+    " product : <value> (('*' | '/') <value>)*;                    "
+    " ident : /[a-z]+/ ;                                           "
+    " call : <ident> '(' <expression> (',' <expression>)* ')' ;    "
+    " index : <ident> '[' <expression> ']' ;                       "
+    " value : /[0-9]+/ | '(' <expression> ')' | <call> | <index> | <ident> ; "
+    " maths : /^/ <expression> /$/;                                ",
+    &g) == NULL);
+  
+  s.maths = mpc_grammar_rule(g, "maths");
+  s.failures = 0;
+  PT_ASSERT(s.maths != NULL);
+  
+  for (j = 0; j < 4; j++) {
+    if (mpc_parse("<test>", inputs[j], s.maths, &r)) {
+      s.asts[j] = r.output;
+      s.errs[j] = NULL;
+    } else {
+      s.asts[j] = NULL;
+      s.errs[j] = mpc_err_string(r.error);
+      mpc_err_delete(r.error);
+    }
+  }
+  
+  PT_ASSERT(s.asts[0] && s.asts[1] && !s.asts[2] && !s.asts[3]);
+  
+  for (k = 0; k < THREADS; k++) {
+    ss[k] = s;
+    ss[k].id = k;
+    PT_ASSERT(pthread_create(&ts[k], NULL, stress_run, &ss[k]) == 0);
+  }
+  
+  for (k = 0; k < THREADS; k++) {
+    pthread_join(ts[k], NULL);
+    PT_ASSERT(ss[k].failures == 0);
+  }
+  
+  for (j = 0; j < 4; j++) {
+    mpc_ast_delete(s.asts[j]);
+    free(s.errs[j]);
+  }
+  
+  mpc_grammar_delete(g);
+}
+
+void suite_threads(void) {
+  pt_add_test(test_threads, "Test Threads", "Suite Threads");
+}
+
+#else
+
+void suite_threads(void) {}
+
+#endif
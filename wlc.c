@@ -4,6 +4,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "lib/mpc/mpc.h"
 
 //#define DEBUG
@@ -13,6 +17,7 @@
 #define SYS_NAME_LEN		SYM_NAME_LEN
 #define MAX_SYMS_PER_TABLE	128
 #define MAX_EQNS_PER_CAT	 64
+#define MAX_OUTS_PER_CAT	 16
 
 #ifdef DEBUG
 #define DEBUG_PRINT(...) do {fprintf(stderr, __VA_ARGS__ );} while(0)
@@ -31,13 +36,16 @@ enum symbol_type {
 	SYM_INT_VEC,
 	SYM_EQN_VEC,
 	SYM_VEC,
-	SYM_FUN
+	SYM_FUN,
+	SYM_OUT
 };
 
 struct symbol {
 	enum symbol_type type;
 	char name[SYM_NAME_LEN];
 	unsigned int capacity;
+	int assigned;	/* STORAGE set by the main block so far */
+	int input;	/* STORAGE read before the main block sets it */
 };
 
 struct symbol_table {
@@ -58,6 +66,8 @@ int add_symbol(struct symbol_table *table, char *name,
 	strcpy(table->symbols[i].name, name);
 	table->symbols[i].type = type;
 	table->symbols[i].capacity = capacity;
+	table->symbols[i].assigned = 0;
+	table->symbols[i].input = 0;
 
 	table->num_symbols++;
 
@@ -112,6 +122,8 @@ struct catastrophe {
 	struct symbol_table sym_table;
 	struct system systems[MAX_EQNS_PER_CAT];
 	unsigned int num_systems;
+	mpc_ast_t *outputs[MAX_OUTS_PER_CAT];
+	unsigned int num_outputs;
 };
 
 enum parser_state{
@@ -140,6 +152,27 @@ struct catastrophe   catastrophe;
 enum   parser_state  parser_state   = PSTATE_INITIAL;
 struct system       *current_system = NULL;
 
+/*
+ * Raw output mode: calculate() keeps the complex result of every point in
+ * separate real/imaginary planes and module/phase are computed later, for the
+ * whole point array at once.
+ */
+int raw_output = 0;
+
+/*
+ * Result cache: calculate() looks points up in memory-mapped tile files keyed
+ * by the catastrophe hash, which covers the source text and every option that
+ * changes the numbers, and computes only those it has not seen before.
+ */
+int result_cache = 0;
+unsigned long long catastrophe_hash;
+
+/*
+ * Batch evaluation: the plugin also exports evaluate_points(), which computes
+ * scattered points given by their parameters rather than a grid of them.
+ */
+int batch_eval = 0;
+
 /*
  * Most of the analyzer's code is data-driven. The following declarations are
  * the set of semantic analysis and generation rules.
@@ -151,6 +184,19 @@ extern struct parse_table_entry *parse_product_table[];
 extern struct parse_table_entry *parse_function_table[];
 extern struct parse_table_entry *parse_expression_table[];
 
+unsigned long long fnv1a(const void *data, size_t size,
+		unsigned long long hash)
+{
+	const unsigned char *p = data;
+
+	while (size--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
 void gen_headers(void)
 {
 	char *str =
@@ -167,6 +213,19 @@ void gen_headers(void)
 	"\t} while(0)\n\n";
 
 	printf("%s\n", str);
+
+	if (result_cache)
+		printf(
+		"#include <fcntl.h>\n"
+		"#include <limits.h>\n"
+		"#include <pthread.h>\n"
+		"#include <stdint.h>\n"
+		"#include <stdio.h>\n"
+		"#include <stdlib.h>\n"
+		"#include <string.h>\n"
+		"#include <sys/mman.h>\n"
+		"#include <sys/stat.h>\n"
+		"#include <unistd.h>\n\n");
 }
 
 void gen_glob_sym_id(struct symbol *symbol)
@@ -215,6 +274,23 @@ void gen_glob_storage(void)
 	printf("};\n\n");
 }
 
+void gen_glob_outputs(void)
+{
+	if (!catastrophe.num_outputs)
+		return;
+
+	printf("\nenum outputs {\n");
+	for_each_symbol_type(&catastrophe.sym_table, SYM_OUT,
+			gen_glob_sym_id);
+	printf("\tlastout\n");
+	printf("};\n\n");
+
+	printf("static char *out_names[] = {");
+	for_each_symbol_type(&catastrophe.sym_table, SYM_OUT,
+			gen_glob_sym_name);
+	printf("NULL};\n");
+}
+
 void gen_loc_sym_name(struct symbol *symbol)
 {
 	printf("%s, ", symbol->name);
@@ -236,6 +312,313 @@ void gen_system_vardecls(void)
 	printf("unused;\n\n");
 }
 
+/*
+ * When something besides calculate() has to run the main block, it is
+ * emitted once as compute(), which evaluates a single point of whatever
+ * instance it is given, and calculate() becomes a thin wrapper around it.
+ * Otherwise the main block is the body of calculate() itself.
+ */
+int separate_compute(void)
+{
+	return batch_eval || result_cache;
+}
+
+void gen_compute(void)
+{
+	printf("\n\nstatic void compute(catastrophe_t *const catastrophe)\n");
+}
+
+void gen_compute_prologue(void)
+{
+	printf(
+		"\tcmplx_equation_t *equation;\n"
+		"\tint nope;\n\n"
+		"\tequation = catastrophe->equation;\n\n"
+	);
+}
+
+int count_storage_inputs(void)
+{
+	int i, c = 0;
+
+	for (i = 0; i < catastrophe.sym_table.num_symbols; i++)
+		c += catastrophe.sym_table.symbols[i].input;
+
+	return c;
+}
+
+void gen_cache_key_storage(struct symbol *symbol)
+{
+	if (!symbol->input)
+		return;
+
+	printf(
+	"\tkey[k++] = creal(STORAGE_COMPLEX(%s));\n"
+	"\tkey[k++] = cimag(STORAGE_COMPLEX(%s));\n",
+		symbol->name, symbol->name);
+}
+
+/*
+ * Every tile of the parameter space is a file holding an open addressing
+ * table of computed points. A tile spans WLC_CACHE_TILE units of every
+ * parameter (CACHE_TILE by default), while variables and input STORAGE
+ * select a tile family of their own by their exact bits, so they never
+ * spread one family's points over many files. A new tile file gets
+ * WLC_CACHE_SLOTS slots (CACHE_SLOTS by default) and later opens go by the
+ * size of the file, so processes with different settings can share it.
+ *
+ * A point is found by the exact bits of its parameters, variables and input
+ * STORAGE and restores the result vector and the storage, so the rest of
+ * calculate() runs as if compute() had been called. Each slot carries a
+ * sequence count: 0 is empty, odd while a writer fills it in and even once
+ * published. Readers copy a slot and only trust the copy if the count did
+ * not change meanwhile, which lets a full tile evict an older point in
+ * place. The first eviction a thread makes is reported on stderr, since
+ * it means the tile is too coarse for the grid being rendered.
+ */
+void gen_cache(void)
+{
+	int num_inputs = count_storage_inputs();
+	int num_storage = count_symbol_type(&catastrophe.sym_table, SYM_STORAGE);
+
+	printf(
+	"\n\n#define CACHE_HASH\t0x%016llxULL\n"
+	"#define CACHE_KEYS\t(lastpar + lastvar + %d)\n"
+	"#define CACHE_SLOTS\t4096\n"
+	"#define CACHE_PROBES\t16\n"
+	"#define CACHE_TILE\t0.125\n\n"
+	"struct cache_entry {\n"
+	"\tdouble key[CACHE_KEYS];\n"
+	"\tdouble complex vector[%d];\n",
+		catastrophe_hash, 2 * num_inputs,
+		current_system->num_equations);
+
+	if (num_storage)
+		printf("\tdouble complex storage[%d];\n", num_storage);
+
+	printf(
+	"\tunsigned int seq;\n"
+	"};\n\n"
+	"static __thread struct {\n"
+	"\tuint64_t id;\n"
+	"\tstruct cache_entry *entries;\n"
+	"\tsize_t slots;\n"
+	"\tdouble tile;\n"
+	"\tint warned;\n"
+	"} cache_tile;\n\n"
+	"static pthread_key_t cache_thread;\n"
+	"static pthread_once_t cache_thread_once = PTHREAD_ONCE_INIT;\n\n"
+	"static uint64_t cache_hash(const void *data, size_t size, uint64_t hash)\n"
+	"{\n"
+	"\tconst unsigned char *p = data;\n\n"
+	"\twhile (size--) {\n"
+	"\t\thash ^= *p++;\n"
+	"\t\thash *= 0x100000001b3ULL;\n"
+	"\t}\n\n"
+	"\treturn hash;\n"
+	"}\n\n"
+	"static double cache_setting(const char *name, double value)\n"
+	"{\n"
+	"\tconst char *s = getenv(name);\n"
+	"\tdouble v;\n\n"
+	"\tif (!s)\n"
+	"\t\treturn value;\n\n"
+	"\tv = strtod(s, NULL);\n\n"
+	"\treturn v > 0 ? v : value;\n"
+	"}\n\n"
+	"/* The mapping of a thread's last tile goes away with the thread. */\n"
+	"static void cache_unmap(void *data)\n"
+	"{\n"
+	"\tif (cache_tile.entries)\n"
+	"\t\tmunmap(cache_tile.entries,\n"
+	"\t\t\tcache_tile.slots * sizeof(struct cache_entry));\n"
+	"\tcache_tile.entries = NULL;\n"
+	"}\n\n"
+	"static void cache_thread_init(void)\n"
+	"{\n"
+	"\tpthread_key_create(&cache_thread, cache_unmap);\n"
+	"}\n\n"
+	"static struct cache_entry *cache_open(const double *key)\n"
+	"{\n"
+	"\tstruct cache_entry *entries;\n"
+	"\tint64_t tile[lastpar + 1];\n"
+	"\tchar path[PATH_MAX];\n"
+	"\tconst char *dir;\n"
+	"\tstruct stat st;\n"
+	"\tuint64_t id;\n"
+	"\tsize_t slots;\n"
+	"\tint k, fd;\n\n"
+	"\tif (!cache_tile.tile) {\n"
+	"\t\tcache_tile.tile = cache_setting(\"WLC_CACHE_TILE\", CACHE_TILE);\n"
+	"\t\tpthread_once(&cache_thread_once, cache_thread_init);\n"
+	"\t\tpthread_setspecific(cache_thread, &cache_tile);\n"
+	"\t}\n\n"
+	"\tfor (k = 0; k < lastpar; k++)\n"
+	"\t\ttile[k] = floor(key[k] / cache_tile.tile);\n"
+	"\tid = cache_hash(&cache_tile.tile, sizeof(cache_tile.tile),\n"
+	"\t\t\tCACHE_HASH);\n"
+	"\tid = cache_hash(tile, lastpar * sizeof(*tile), id);\n"
+	"\tid = cache_hash(key + lastpar, (CACHE_KEYS - lastpar) * sizeof(*key),\n"
+	"\t\t\tid);\n\n"
+	"\tif (cache_tile.entries && cache_tile.id == id)\n"
+	"\t\treturn cache_tile.entries;\n\n"
+	"\tif (cache_tile.entries)\n"
+	"\t\tmunmap(cache_tile.entries,\n"
+	"\t\t\tcache_tile.slots * sizeof(struct cache_entry));\n"
+	"\tcache_tile.entries = NULL;\n\n"
+	"\tdir = getenv(\"WLC_CACHE_DIR\");\n"
+	"\tif (!dir)\n"
+	"\t\tdir = \".wlc-cache\";\n"
+	"\tmkdir(dir, 0755);\n\n"
+	"\tsnprintf(path, sizeof(path), \"%%s/%%016llx-%%016llx.tile\", dir,\n"
+	"\t\t(unsigned long long) CACHE_HASH, (unsigned long long) id);\n\n"
+	"\tfd = open(path, O_RDWR | O_CREAT, 0644);\n"
+	"\tif (fd < 0)\n"
+	"\t\treturn NULL;\n\n"
+	"\t/* Only ever grows the file, so no mapping of it is cut short. */\n"
+	"\tslots = cache_setting(\"WLC_CACHE_SLOTS\", CACHE_SLOTS);\n"
+	"\tif (posix_fallocate(fd, 0, slots * sizeof(struct cache_entry)) ||\n"
+	"\t    fstat(fd, &st)) {\n"
+	"\t\tclose(fd);\n"
+	"\t\treturn NULL;\n"
+	"\t}\n\n"
+	"\tslots = st.st_size / sizeof(struct cache_entry);\n"
+	"\tentries = mmap(NULL, slots * sizeof(struct cache_entry),\n"
+	"\t\t\tPROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);\n"
+	"\tclose(fd);\n"
+	"\tif (entries == MAP_FAILED)\n"
+	"\t\treturn NULL;\n\n"
+	"\tcache_tile.id = id;\n"
+	"\tcache_tile.entries = entries;\n"
+	"\tcache_tile.slots = slots;\n\n"
+	"\treturn entries;\n"
+	"}\n\n"
+	"static void cache_key(catastrophe_t *const catastrophe, double *key)\n"
+	"{\n"
+	"\tint k = 0, x;\n\n"
+	"\tfor (x = 0; x < lastpar; x++)\n"
+	"\t\tkey[k++] = PARAM(x);\n"
+	"\tfor (x = 0; x < lastvar; x++)\n"
+	"\t\tkey[k++] = VAR(x);\n");
+
+	for_each_symbol_type(&catastrophe.sym_table, SYM_STORAGE,
+			gen_cache_key_storage);
+
+	printf(
+	"}\n\n"
+	"static int cache_lookup(catastrophe_t *const catastrophe, double *key)\n"
+	"{\n"
+	"\tstruct cache_entry *entries, *e;\n"
+	"\tdouble complex vector[%d];\n",
+		current_system->num_equations);
+
+	if (num_storage)
+		printf(
+	"\tdouble complex storage[%d];\n", num_storage);
+
+	printf(
+	"\tunsigned int seq;\n"
+	"\tuint64_t slot;\n"
+	"\tint k;\n");
+
+	if (num_storage)
+		printf(
+	"\tint x;\n");
+
+	printf(
+	"\n"
+	"\tcache_key(catastrophe, key);\n"
+	"\tentries = cache_open(key);\n"
+	"\tif (!entries)\n"
+	"\t\treturn 0;\n\n"
+	"\tslot = cache_hash(key, sizeof(e->key), CACHE_HASH);\n"
+	"\tfor (k = 0; k < CACHE_PROBES; k++) {\n"
+	"\t\te = &entries[(slot + k) %% cache_tile.slots];\n"
+	"\t\tseq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);\n"
+	"\t\tif (!seq)\n"
+	"\t\t\treturn 0;\n"
+	"\t\tif (seq & 1 || memcmp(e->key, key, sizeof(e->key)))\n"
+	"\t\t\tcontinue;\n\n"
+	"\t\tmemcpy(vector, e->vector, sizeof(vector));\n");
+
+	if (num_storage)
+		printf(
+	"\t\tmemcpy(storage, e->storage, sizeof(storage));\n");
+
+	printf(
+	"\t\t__atomic_thread_fence(__ATOMIC_ACQUIRE);\n"
+	"\t\tif (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)\n"
+	"\t\t\treturn 0;\n\n"
+	"\t\tmemcpy(catastrophe->equation->resulting_vector, vector,\n"
+	"\t\t\tsizeof(vector));\n");
+
+	if (num_storage)
+		printf(
+	"\t\tfor (x = 0; x < %d; x++)\n"
+	"\t\t\tSTORAGE_COMPLEX(x) = storage[x];\n", num_storage);
+
+	printf(
+	"\n"
+	"\t\treturn 1;\n"
+	"\t}\n\n"
+	"\treturn 0;\n"
+	"}\n\n"
+	"static void cache_store(catastrophe_t *const catastrophe,\n"
+	"\t\tconst double *key)\n"
+	"{\n"
+	"\tstruct cache_entry *entries, *e;\n"
+	"\tunsigned int seq;\n"
+	"\tuint64_t slot;\n"
+	"\tint k;\n");
+
+	if (num_storage)
+		printf(
+	"\tint x;\n");
+
+	printf(
+	"\n"
+	"\tentries = cache_open(key);\n"
+	"\tif (!entries)\n"
+	"\t\treturn;\n\n"
+	"\tslot = cache_hash(key, sizeof(e->key), CACHE_HASH);\n"
+	"\tfor (k = 0; k < CACHE_PROBES; k++) {\n"
+	"\t\te = &entries[(slot + k) %% cache_tile.slots];\n"
+	"\t\tseq = 0;\n"
+	"\t\tif (__atomic_compare_exchange_n(&e->seq, &seq, 1, 0,\n"
+	"\t\t\t\t__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))\n"
+	"\t\t\tbreak;\n"
+	"\t\tif (!(seq & 1) && !memcmp(e->key, key, sizeof(e->key)))\n"
+	"\t\t\treturn;\n"
+	"\t}\n\n"
+	"\t/* Every probe is taken, so one of them makes room. */\n"
+	"\tif (k == CACHE_PROBES) {\n"
+	"\t\tif (!cache_tile.warned) {\n"
+	"\t\t\tfprintf(stderr, \"wlc cache: tile is full, evicting points; \"\n"
+	"\t\t\t\t\"set a smaller WLC_CACHE_TILE or a larger \"\n"
+	"\t\t\t\t\"WLC_CACHE_SLOTS\\n\");\n"
+	"\t\t\tcache_tile.warned = 1;\n"
+	"\t\t}\n\n"
+	"\t\te = &entries[(slot + (slot >> 32) %% CACHE_PROBES) %%\n"
+	"\t\t\tcache_tile.slots];\n"
+	"\t\tseq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);\n"
+	"\t\tif (seq & 1 || !__atomic_compare_exchange_n(&e->seq, &seq,\n"
+	"\t\t\t\tseq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))\n"
+	"\t\t\treturn;\n"
+	"\t}\n\n"
+	"\tmemcpy(e->key, key, sizeof(e->key));\n"
+	"\tmemcpy(e->vector, catastrophe->equation->resulting_vector,\n"
+	"\t\tsizeof(e->vector));\n");
+
+	if (num_storage)
+		printf(
+	"\tfor (x = 0; x < %d; x++)\n"
+	"\t\te->storage[x] = STORAGE_COMPLEX(x);\n", num_storage);
+
+	printf(
+	"\t__atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);\n"
+	"}\n");
+}
+
 void gen_main_block(void)
 {
 	printf("\n\nstatic void calculate(catastrophe_t *const catastrophe,\n"
@@ -246,23 +629,169 @@ void gen_main_block_prologue(void)
 {
 	printf(
 		"\tcmplx_equation_t *equation;\n"
-		"\tpoint_array_t *point_array;\n"
-		"\tdouble module, phase;\n"
-		"\tint nope;\n\n"
+		"\tpoint_array_t *point_array;\n");
+
+	/* Declared outputs take over the default module/phase pair. */
+	if (!catastrophe.num_outputs && !raw_output)
+		printf("\tdouble module, phase;\n");
+
+	if (result_cache)
+		printf("\tdouble key[CACHE_KEYS];\n");
+
+	if (!separate_compute())
+		printf("\tint nope;\n");
+
+	printf(
+		"\n"
 		"\tequation = catastrophe->equation;\n"
 		"\tpoint_array = catastrophe->point_array;\n\n"
 	);
+
+	if (result_cache)
+		printf(
+		"\tif (!cache_lookup(catastrophe, key)) {\n"
+		"\t\tcompute(catastrophe);\n"
+		"\t\tcache_store(catastrophe, key);\n"
+		"\t}\n");
+	else if (separate_compute())
+		printf("\tcompute(catastrophe);\n");
 }
 
 void gen_main_block_epilogue(void)
 {
 	printf(
-	"\n\n\tmodule = cabs(equation->resulting_vector[0]);\n"
+	"\n\tmodule = cabs(equation->resulting_vector[0]);\n"
 	"\tphase = (180.0 / M_PI) * carg(equation->resulting_vector[0]);\n\n"
 	"\tpoint_array->array[i][j].module = module;\n"
 	"\tpoint_array->array[i][j].phase = phase;\n");
 }
 
+void gen_main_block_epilogue_raw(void)
+{
+	printf(
+	"\n\tpoint_array->re[i][j] = creal(equation->resulting_vector[0]);\n"
+	"\tpoint_array->im[i][j] = cimag(equation->resulting_vector[0]);\n");
+}
+
+/*
+ * Module and phase of the raw planes, computed in bulk once the host asks
+ * for them: after calculate() has run for every point of the grid, the
+ * host calls finalize() with the grid size, see the README. hypot() and atan2() are library calls, so this is a plain loop
+ * over the real and imaginary planes rather than vectorized code; what it
+ * saves is keeping them out of calculate() for points nobody looks at.
+ */
+void gen_finalize(void)
+{
+	printf(
+	"\n\nstatic void finalize(catastrophe_t *const catastrophe,\n"
+	"\t\tconst unsigned int width, const unsigned int height)\n"
+	"{\n"
+	"\tpoint_array_t *point_array;\n"
+	"\tunsigned int i, j;\n\n"
+	"\tpoint_array = catastrophe->point_array;\n\n"
+	"\tfor (i = 0; i < width; i++) {\n"
+	"\t\tconst double *re = point_array->re[i];\n"
+	"\t\tconst double *im = point_array->im[i];\n\n"
+	"\t\tfor (j = 0; j < height; j++) {\n"
+	"\t\t\tpoint_array->array[i][j].module = hypot(re[j], im[j]);\n"
+	"\t\t\tpoint_array->array[i][j].phase =\n"
+	"\t\t\t\t(180.0 / M_PI) * atan2(im[j], re[j]);\n"
+	"\t\t}\n"
+	"\t}\n"
+	"}\n");
+}
+
+/*
+ * Batch evaluation at scattered points. Parameters come in SoA layout,
+ * params[k * n + p] being parameter k of point p. Each call works on an
+ * instance of its own, so concurrent calls do not share any state. The
+ * variables and STORAGE of that instance are copied from the caller's
+ * `base` instance first, so a point gets the same value calculate() would
+ * give for it on `base`. The macros only know `catastrophe`, so `base` is
+ * read through a shadowing declaration of that name.
+ */
+void gen_evaluate_points(void)
+{
+	int num_storage = count_symbol_type(&catastrophe.sym_table, SYM_STORAGE);
+
+	printf(
+	"\n\nstatic catastrophe_desc_t catastrophe_%s_desc;\n\n"
+	"static int evaluate_points(const catastrophe_t *const base,\n"
+	"\t\tconst double *params, size_t n, double complex *out)\n"
+	"{\n"
+	"\tcatastrophe_t *catastrophe;\n"
+	"\tcmplx_equation_t *equation;\n"
+	"\tdouble var;\n",
+		catastrophe.name);
+
+	if (num_storage)
+		printf("\tdouble complex storage;\n");
+
+	printf(
+	"\tsize_t p;\n"
+	"\tint k;\n\n"
+	"\tcatastrophe = catastrophe_fabric(&catastrophe_%s_desc);\n"
+	"\tif (!catastrophe)\n"
+	"\t\treturn -1;\n\n"
+	"\tequation = catastrophe->equation;\n\n"
+	"\tfor (k = 0; k < lastvar; k++) {\n"
+	"\t\t{\n"
+	"\t\t\tconst catastrophe_t *const catastrophe = base;\n"
+	"\t\t\tvar = VAR(k);\n"
+	"\t\t}\n"
+	"\t\tVAR(k) = var;\n"
+	"\t}\n",
+		catastrophe.name);
+
+	if (num_storage)
+		printf(
+	"\tfor (k = 0; k < %d; k++) {\n"
+	"\t\t{\n"
+	"\t\t\tconst catastrophe_t *const catastrophe = base;\n"
+	"\t\t\tstorage = STORAGE_COMPLEX(k);\n"
+	"\t\t}\n"
+	"\t\tSTORAGE_COMPLEX(k) = storage;\n"
+	"\t}\n", num_storage);
+
+	printf(
+	"\n"
+	"\tfor (p = 0; p < n; p++) {\n"
+	"\t\tfor (k = 0; k < lastpar; k++)\n"
+	"\t\t\tPARAM(k) = params[k * n + p];\n\n"
+	"\t\tcompute(catastrophe);\n");
+}
+
+void gen_evaluate_points_result(void)
+{
+	printf("\t\tout[p] = equation->resulting_vector[0];\n");
+}
+
+void gen_evaluate_points_epilogue(void)
+{
+	printf(
+	"\t}\n\n"
+	"\tcatastrophe_destroy(catastrophe);\n\n"
+	"\treturn 0;\n"
+	"}\n");
+}
+
+/*
+ * Declared outputs go to point_array->channels[output][i][j], and the
+ * descriptor names them through num_outputs and out_names. The host has
+ * to provide these fields, see the README.
+ */
+void gen_output(mpc_ast_t *output)
+{
+	printf("\tpoint_array->channels[%s][i][j] = ",
+			output->children[0]->contents);
+}
+
+/* Declared outputs of a point are laid out as out[channel * n + p]. */
+void gen_output_point(mpc_ast_t *output)
+{
+	printf("\t\tout[%s * n + p] = ", output->children[0]->contents);
+}
+
 void gen_desc(void)
 {
 	printf(
@@ -275,14 +804,30 @@ void gen_desc(void)
 	"\t.par_names = par_names,\n"
 	"\t.var_names = var_names,\n"
 	"\t.equation.cmplx = catastrophe_%s_function,\n"
-	"\t.num_equations = %d,\n"
-	"\t.calculate = calculate,\n"
-	"};\n\n",
+	"\t.num_equations = %d,\n",
 		catastrophe.name, catastrophe.name,
 		count_symbol_type(&catastrophe.sym_table, SYM_PAR),
 		count_symbol_type(&catastrophe.sym_table, SYM_VAR),
 		current_system->name,
 		current_system->num_equations);
+
+	if (catastrophe.num_outputs) {
+		printf(
+		"\t.num_outputs = %d,\n"
+		"\t.out_names = out_names,\n",
+			catastrophe.num_outputs);
+	}
+
+	if (raw_output)
+		printf("\t.finalize = finalize,\n");
+
+	printf(
+	"\t.calculate = calculate,\n");
+
+	if (batch_eval)
+		printf("\t.evaluate_points = evaluate_points,\n");
+
+	printf("};\n\n");
 }
 
 void gen_init(void)
@@ -300,34 +845,70 @@ void gen_init(void)
 
 void gen_rest(void)
 {
+	if (raw_output)
+		gen_finalize();
 	gen_desc();
 	gen_init();
 }
 
+/*
+ * Nodes keep the tags of every rule they were collapsed through, so the
+ * brackets of a parenthesized expression are the "value|expression|" parts
+ * of its tag. Rules are matched on what the brackets enclose, and a node
+ * with children on the innermost rule it is the result of.
+ */
+char *rule_tag(mpc_ast_t *ast, int *parens)
+{
+	char *tag = ast->tag, *p;
+	int i;
+
+	*parens = 0;
+	while ((p = strstr(tag, "value|expression|"))) {
+		tag = p + strlen("value|");
+		(*parens)++;
+	}
+
+	if (ast->children_num && strlen(tag) > 1) {
+		for (i = strlen(tag) - 2; i > 0 && tag[i - 1] != '|'; i--)
+			;
+		tag += i;
+	}
+
+	return tag;
+}
+
 int apply_parse_rule(mpc_ast_t *ast, mpc_ast_t *par_ast,
 		struct symbol_table *sym_table,
 		struct parse_table_entry *parse_table[], int strict)
 {
-	int i, ret;
+	int i, j, ret, parens = 0;
+	char *tag = ast->tag;
+
+	if (strict)
+		tag = rule_tag(ast, &parens);
 
 	for (i = 0; parse_table[i]; i++) {
 		int match = 0;
 
 		switch (strict) {
 		case 1:
-			if (ast->tag == strstr(ast->tag, parse_table[i]->tag))
+			if (tag == strstr(tag, parse_table[i]->tag))
 				match = 1;
 			break;
 		default:
-			if (strstr(ast->tag, parse_table[i]->tag))
+			if (strstr(tag, parse_table[i]->tag))
 				match = 1;
 		};
 
 		if (match) {
+			for (j = 0; j < parens; j++)
+				printf("(");
 			ret = parse_table[i]->func(ast, sym_table,
 					*parse_table[i]->parse_table);
 			if (ret)
 				return -1;
+			for (j = 0; j < parens; j++)
+				printf(")");
 
 			return 0;
 		}
@@ -341,19 +922,12 @@ int apply_parse_rule(mpc_ast_t *ast, mpc_ast_t *par_ast,
 	return -1;
 }
 
-int walk_something(mpc_ast_t *ast, struct symbol_table *sym_table,
+int walk_children(mpc_ast_t *ast, int first, struct symbol_table *sym_table,
 		struct parse_table_entry *parse_table[])
 {
 	int i, ret;
 
-	if (strlen(ast->contents)) {
-		ret = apply_parse_rule(ast, ast, sym_table,
-				parse_leaf_table, 0);
-		if (ret)
-			return -1;
-	}
-
-	for (i = 0; i < ast->children_num; i++) {
+	for (i = first; i < ast->children_num; i++) {
 		if (strstr(ast->children[i]->tag, "char")) {
 			printf("%s", ast->children[i]->contents);
 		} else {
@@ -367,6 +941,21 @@ int walk_something(mpc_ast_t *ast, struct symbol_table *sym_table,
 	return 0;
 }
 
+int walk_something(mpc_ast_t *ast, struct symbol_table *sym_table,
+		struct parse_table_entry *parse_table[])
+{
+	int ret;
+
+	if (strlen(ast->contents)) {
+		ret = apply_parse_rule(ast, ast, sym_table,
+				parse_leaf_table, 0);
+		if (ret)
+			return -1;
+	}
+
+	return walk_children(ast, 0, sym_table, parse_table);
+}
+
 int walk_variable(mpc_ast_t *ast, struct symbol_table *sym_table,
 		struct parse_table_entry *parse_table[])
 {
@@ -427,7 +1016,7 @@ int walk_array(mpc_ast_t *ast, struct symbol_table *sym_table,
 		return -1;
 	}
 
-	if (atoi(ast->children[2]->contents) >= sym->capacity) {
+	if (atoi(ast->children[1]->contents) >= sym->capacity) {
 		ERROR_PRINT("Array out of bounds access!\n");
 		return -1;
 	}
@@ -443,11 +1032,11 @@ int walk_array(mpc_ast_t *ast, struct symbol_table *sym_table,
 
 		if (0 == strcmp(ast->children[0]->contents, "sysinput")) {
 			printf("equation->initial_vector[%s]",
-					ast->children[2]->contents);
+					ast->children[1]->contents);
 		} else if (0 == strcmp(ast->children[0]->contents,
 					"sysresult")) {
 			printf("equation->resulting_vector[%s]",
-					ast->children[2]->contents);
+					ast->children[1]->contents);
 		} else {
 			ERROR_PRINT("Unexpected EQN symbol!\n");
 			return -1;
@@ -461,7 +1050,7 @@ int walk_array(mpc_ast_t *ast, struct symbol_table *sym_table,
 		}
 	default:
 		printf("%s[%s]", ast->children[0]->contents,
-				ast->children[2]->contents);
+				ast->children[1]->contents);
 	}
 
 	return 0;
@@ -482,6 +1071,10 @@ char *known_functions[] = {
 	"cos",
 	"sin",
 	"cexp",
+	"creal",
+	"cimag",
+	"cabs",
+	"carg",
 	NULL
 };
 
@@ -513,6 +1106,27 @@ int walk_funcname(mpc_ast_t *ast, struct symbol_table *sym_table,
 	return -1;
 }
 
+/* The brackets and commas of a call are not in the AST. */
+int walk_function(mpc_ast_t *ast, struct symbol_table *sym_table,
+		struct parse_table_entry *parse_table[])
+{
+	int i, ret;
+
+	for (i = 0; i < ast->children_num; i++) {
+		if (i > 1)
+			printf(",");
+		ret = apply_parse_rule(ast->children[i], ast,
+				sym_table, parse_table, 1);
+		if (ret)
+			return -1;
+		if (i == 0)
+			printf("(");
+	}
+	printf(")");
+
+	return 0;
+}
+
 int walk_echo(mpc_ast_t *ast, struct symbol_table *sym_table,
 		struct parse_table_entry *parse_table[])
 {
@@ -549,7 +1163,7 @@ struct parse_table_entry parse_product =
 	{"product|", walk_something, parse_product_table};
 
 struct parse_table_entry parse_function =
-	{"function|", walk_something, parse_function_table};
+	{"function|", walk_function, parse_function_table};
 
 struct parse_table_entry parse_funcname =
 	{"funcname|", walk_funcname, NULL};
@@ -559,6 +1173,10 @@ struct parse_table_entry parse_ass_regex =
 
 struct parse_table_entry *parse_value_table[] = {
 	&parse_expression,
+	&parse_product,
+	&parse_function,
+	&parse_array,
+	&parse_value,
 	NULL
 };
 
@@ -567,12 +1185,15 @@ struct parse_table_entry *parse_product_table[] = {
 	&parse_array,
 	&parse_value_variable,
 	&parse_value,
+	&parse_expression,
+	&parse_product,
 	NULL
 };
 
 struct parse_table_entry *parse_function_table[] = {
 	&parse_expression,
 	&parse_funcname,
+	&parse_array,
 	&parse_product,
 	NULL
 };
@@ -582,6 +1203,7 @@ struct parse_table_entry *parse_expression_table[] = {
 	&parse_product,
 	&parse_function,
 	&parse_expression,
+	&parse_value,
 	NULL
 };
 
@@ -593,6 +1215,7 @@ struct parse_table_entry *parse_assignment[] = {
 	&parse_array,
 	&parse_expression,
 	&parse_product,
+	&parse_value,
 	NULL
 };
 
@@ -625,7 +1248,7 @@ int walk_level0_parlist(mpc_ast_t *ast)
 {
 	int i, ret;
 
-	for (i = 1; i < ast->children_num - 1; i+=2) {
+	for (i = 1; i < ast->children_num; i++) {
 		DEBUG_PRINT("Param found: %s.\n", ast->children[i]->contents);
 		ret = add_symbol(&catastrophe.sym_table,
 				ast->children[i]->contents, SYM_PAR, 0);
@@ -641,7 +1264,7 @@ int walk_varlist(mpc_ast_t *ast, struct symbol_table *sym_table,
 {
 	int i, ret;
 
-	for (i = 1; i < ast->children_num - 1; i+=2) {
+	for (i = 1; i < ast->children_num; i++) {
 		DEBUG_PRINT("Var found: %s.\n", ast->children[i]->contents);
 			ret = add_symbol(sym_table, ast->children[i]->contents,
 					type, 0);
@@ -671,14 +1294,14 @@ int walk_level0_veclist(mpc_ast_t *ast)
 {
 	int i, ret;
 
-	for (i = 1; i < ast->children_num - 1; i++) {
+	for (i = 1; i < ast->children_num; i++) {
 		mpc_ast_t *arr = ast->children[i];
 		DEBUG_PRINT("Vec found: %s[%s].\n",
 				arr->children[0]->contents,
-				arr->children[2]->contents);
+				arr->children[1]->contents);
 		ret = add_symbol(&catastrophe.sym_table,
 			arr->children[0]->contents, SYM_VEC,
-			(unsigned int)atoi(arr->children[2]->contents));
+			(unsigned int)atoi(arr->children[1]->contents));
 		if (ret)
 			return -1;
 	}
@@ -686,6 +1309,42 @@ int walk_level0_veclist(mpc_ast_t *ast)
 	return 0;
 }
 
+int walk_level0_outlist(mpc_ast_t *ast)
+{
+	int i, ret;
+
+	if (raw_output) {
+		ERROR_PRINT("Raw output mode cannot be used with OUTPUT!\n");
+		return -1;
+	}
+
+	for (i = 1; i < ast->children_num; i++) {
+		mpc_ast_t *out = ast->children[i];
+		DEBUG_PRINT("Output found: %s.\n", out->children[0]->contents);
+
+		if (catastrophe.num_outputs >= MAX_OUTS_PER_CAT) {
+			ERROR_PRINT("Too many outputs!\n");
+			return -1;
+		}
+
+		if (find_symbol(&catastrophe.sym_table,
+				out->children[0]->contents)) {
+			ERROR_PRINT("Output name is already in use: %s!\n",
+					out->children[0]->contents);
+			return -1;
+		}
+
+		ret = add_symbol(&catastrophe.sym_table,
+				out->children[0]->contents, SYM_OUT, 0);
+		if (ret)
+			return -1;
+
+		catastrophe.outputs[catastrophe.num_outputs++] = out;
+	}
+
+	return 0;
+}
+
 int walk_assignment(mpc_ast_t *ast, struct symbol_table *sym_table)
 {
 	int ret;
@@ -703,7 +1362,7 @@ int walk_block(mpc_ast_t *ast, struct symbol_table *sym_table)
 {
 	int i, ret;
 
-	for (i = 1; i < ast->children_num - 1; i+=2) {
+	for (i = 1; i < ast->children_num - 1; i++) {
 		printf("\t");
 		ret = walk_assignment(ast->children[i], sym_table);
 		if (ret)
@@ -713,15 +1372,54 @@ int walk_block(mpc_ast_t *ast, struct symbol_table *sym_table)
 	return 0;
 }
 
+/*
+ * STORAGE keeps its value from one point to the next, so one that is read
+ * before the main block sets it is an input of the point just like the
+ * parameters and variables, and has to be part of the cache key. Systems run
+ * in the middle of the main block, so anything they read counts as well.
+ */
+void mark_storage_inputs(mpc_ast_t *ast)
+{
+	struct symbol *sym;
+	int i;
+
+	if (strstr(ast->tag, "variable") && !strstr(ast->tag, "leftside")) {
+		sym = find_symbol(&catastrophe.sym_table, ast->contents);
+		if (sym && sym->type == SYM_STORAGE && !sym->assigned)
+			sym->input = 1;
+	}
+
+	for (i = 0; i < ast->children_num; i++)
+		mark_storage_inputs(ast->children[i]);
+}
+
+void mark_storage_assigned(mpc_ast_t *block)
+{
+	struct symbol *sym;
+	int i, k;
+
+	for (i = 1; i < block->children_num - 1; i++) {
+		mpc_ast_t *ass = block->children[i];
+
+		for (k = 1; k < ass->children_num; k++)
+			mark_storage_inputs(ass->children[k]);
+
+		sym = find_symbol(&catastrophe.sym_table,
+				ass->children[0]->contents);
+		if (sym && sym->type == SYM_STORAGE)
+			sym->assigned = 1;
+	}
+}
+
 int walk_level0_system(mpc_ast_t *ast)
 {
 	int i, ret;
 
 	DEBUG_PRINT("System found: %s(%s).\n", ast->children[1]->contents,
-			ast->children[3]->contents);
+			ast->children[2]->contents);
 
 	ret = add_system(&catastrophe, ast->children[1]->contents,
-			(unsigned int)atoi(ast->children[3]->contents));
+			(unsigned int)atoi(ast->children[2]->contents));
 	if (ret)
 		return -1;
 
@@ -743,7 +1441,7 @@ int walk_level0_system(mpc_ast_t *ast)
 	add_symbol(&catastrophe.sym_table, ast->children[1]->contents,
 		SYM_FUN, 0);
 
-	i = 5;
+	i = 3;
 	while (0 == strcmp(ast->children[i]->tag, "varlist|>")) {
 		ret = walk_system_varlist(ast->children[i], current_system);
 		if (ret)
@@ -755,6 +1453,8 @@ int walk_level0_system(mpc_ast_t *ast)
 
 	gen_system_vardecls();
 
+	mark_storage_inputs(ast->children[i]);
+
 	ret = walk_block(ast->children[i], &current_system->sym_table);
 	if (ret)
 		return -1;
@@ -764,13 +1464,79 @@ int walk_level0_system(mpc_ast_t *ast)
 	return 0;
 }
 
+/*
+ * Outputs are computed in calculate() after compute() has returned, so they
+ * can only use what outlives a point: parameters, variables, storage, the
+ * results of the main block and the I and M_PI constants.
+ */
+int check_output_names(mpc_ast_t *ast)
+{
+	struct symbol *sym;
+	char *name;
+	int i, first = 0;
+
+	if (strstr(ast->tag, "array")) {
+		name = ast->children[0]->contents;
+		if (strcmp(name, "sysresult")) {
+			ERROR_PRINT("Unknown symbol in OUTPUT: %s!\n", name);
+			return -1;
+		}
+		first = 1;
+	} else if (strstr(ast->tag, "variable")) {
+		name = ast->contents;
+		sym = find_symbol(&catastrophe.sym_table, name);
+		if (!sym || !(sym->type == SYM_PAR || sym->type == SYM_VAR ||
+		    sym->type == SYM_STORAGE || !strcmp(name, "I") ||
+		    !strcmp(name, "M_PI"))) {
+			ERROR_PRINT("Unknown symbol in OUTPUT: %s!\n", name);
+			return -1;
+		}
+	}
+
+	for (i = first; i < ast->children_num; i++) {
+		if (check_output_names(ast->children[i]))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Every declared output is an expression over the results of the main block,
+ * so all of them are stored right after the integration of a single point.
+ */
+int walk_outputs(void (*gen)(mpc_ast_t *output))
+{
+	int i, k, ret;
+
+	for (i = 0; i < catastrophe.num_outputs; i++) {
+		mpc_ast_t *out = catastrophe.outputs[i];
+
+		for (k = 2; k < out->children_num; k++) {
+			if (check_output_names(out->children[k]))
+				return -1;
+		}
+
+		gen(out);
+		ret = walk_children(out, 2, NULL, parse_assignment);
+		if (ret)
+			return -1;
+		printf(";\n");
+	}
+
+	return 0;
+}
+
 int walk_level0_main_block(mpc_ast_t *ast)
 {
 	int i, ret;
 
 	DEBUG_PRINT("Main block found.\n");
 
-	gen_main_block();
+	if (separate_compute())
+		gen_compute();
+	else
+		gen_main_block();
 	add_symbol(&catastrophe.sym_table, "sysinput", SYM_EQN_VEC,
 			current_system->num_equations);
 	add_symbol(&catastrophe.sym_table, "sysresult", SYM_EQN_VEC,
@@ -781,16 +1547,65 @@ int walk_level0_main_block(mpc_ast_t *ast)
 
 	printf("{\n");
 
-	gen_main_block_prologue();
+	if (separate_compute())
+		gen_compute_prologue();
+	else
+		gen_main_block_prologue();
 
 	ret = walk_block(ast, NULL);
 	if (ret)
 		return -1;
 
-	gen_main_block_epilogue();
+	if (separate_compute())
+		printf("}\n");
+	else
+		printf("\n");
+
+	if (result_cache) {
+		mark_storage_assigned(ast);
+		for (i = 0; i < catastrophe.num_outputs; i++)
+			mark_storage_inputs(catastrophe.outputs[i]);
+
+		if (!count_symbol_type(&catastrophe.sym_table, SYM_PAR) &&
+		    !count_symbol_type(&catastrophe.sym_table, SYM_VAR) &&
+		    !count_storage_inputs()) {
+			ERROR_PRINT("Nothing to key the result cache on!\n");
+			return -1;
+		}
+		gen_cache();
+	}
+
+	if (separate_compute()) {
+		gen_main_block();
+		printf("{\n");
+		gen_main_block_prologue();
+	}
+
+	if (catastrophe.num_outputs) {
+		printf("\n");
+		ret = walk_outputs(gen_output);
+		if (ret)
+			return -1;
+	} else if (raw_output) {
+		gen_main_block_epilogue_raw();
+	} else {
+		gen_main_block_epilogue();
+	}
 
 	printf("}\n");
 
+	if (batch_eval) {
+		gen_evaluate_points();
+		if (catastrophe.num_outputs) {
+			ret = walk_outputs(gen_output_point);
+			if (ret)
+				return -1;
+		} else {
+			gen_evaluate_points_result();
+		}
+		gen_evaluate_points_epilogue();
+	}
+
 	return 0;
 }
 
@@ -819,6 +1634,7 @@ int walk_level0(mpc_ast_t *ast)
 			gen_glob_parameters();
 			gen_glob_variables();
 			gen_glob_storage();
+			gen_glob_outputs();
 			parser_state = PSTATE_LEVEL0_SYSTEM;
 			ret = walk_level0_system(ast);
 			if (ret)
@@ -826,26 +1642,31 @@ int walk_level0(mpc_ast_t *ast)
 			break;
 		}
 	case PSTATE_LEVEL0_DECL:
-		if (0 == strcmp(ast->tag, "parlist|>")) {
+		if (0 == strcmp(ast->tag, "declare|parlist|>")) {
 			ret = walk_level0_parlist(ast);
 			if (ret)
 				return -1;
 			parser_state = PSTATE_LEVEL0_AFTER_DECL;
-		} else if (0 == strcmp(ast->tag, "varlist|>")) {
+		} else if (0 == strcmp(ast->tag, "declare|varlist|>")) {
 			ret = walk_level0_varlist(ast);
 			if (ret)
 				return -1;
 			parser_state = PSTATE_LEVEL0_AFTER_DECL;
-		} else if (0 == strcmp(ast->tag, "veclist|>")) {
+		} else if (0 == strcmp(ast->tag, "declare|veclist|>")) {
 			ret = walk_level0_veclist(ast);
 			if (ret)
 				return -1;
 			parser_state = PSTATE_LEVEL0_AFTER_DECL;
-		} else if (0 == strcmp(ast->tag, "strlist|>")) {
+		} else if (0 == strcmp(ast->tag, "declare|strlist|>")) {
 			ret = walk_level0_strlist(ast);
 			if (ret)
 				return -1;
 			parser_state = PSTATE_LEVEL0_AFTER_DECL;
+		} else if (0 == strcmp(ast->tag, "declare|outlist|>")) {
+			ret = walk_level0_outlist(ast);
+			if (ret)
+				return -1;
+			parser_state = PSTATE_LEVEL0_AFTER_DECL;
 		} else {
 			ERROR_PRINT("One of declaration lists expected!\n");
 			return -1;
@@ -900,137 +1721,251 @@ int walk_ast(mpc_ast_t *ast)
 	return walk_catastrophe(ast);
 }
 
-int parser(char *input)
-{
-	mpc_parser_t *Integer = mpc_new("integer");
-	mpc_parser_t *Float = mpc_new("float");
-	mpc_parser_t *Expression = mpc_new("expression");
-	mpc_parser_t *Product = mpc_new("product");
-	mpc_parser_t *Value = mpc_new("value");
-	mpc_parser_t *Variable = mpc_new("variable");
-	mpc_parser_t *Array = mpc_new("array");
-	mpc_parser_t *Leftside = mpc_new("leftside");
-	mpc_parser_t *Assignment = mpc_new("assignment");
-	mpc_parser_t *Block = mpc_new("block");
-	mpc_parser_t *Varlist = mpc_new("varlist");
-	mpc_parser_t *Parlist = mpc_new("parlist");
-	mpc_parser_t *Veclist = mpc_new("veclist");
-	mpc_parser_t *Strlist = mpc_new("strlist");
-	mpc_parser_t *System = mpc_new("system");
-	mpc_parser_t *Catastrophe = mpc_new("catastrophe");
-	mpc_parser_t *Declare = mpc_new("declare");
-	mpc_parser_t *Function = mpc_new("function");
-	mpc_parser_t *Funcname = mpc_new("funcname");
-
-	mpca_lang(MPCA_LANG_DEFAULT,
-			"integer \"integer\" : /[0-9]+/ ;"
-			"float \"float\" : /[0-9]*\\.?[0-9]+/ ;"
-			"variable \"variable\" : /[A-Za-z'_']+[A-Za-z0-9'_']*/ ;"
-			"funcname \"funcname\" : /[A-Za-z'_']+[A-Za-z0-9'_']*/ ;"
-			"array : <variable> '[' <expression> ']' ;"
-			"expression : <product> (('+' | '-') <product>)* ;"
-			"product : <value> (('*' | '/') <value>)* ;"
-			"value : '(' <expression> ')' | <float> | <integer> | <function> | <array> | <variable> ;"
-			"leftside : <array> | <variable> ;"
-			"assignment : <leftside> /<-/ <expression> ;"
-			"block : /BEGIN/ (<assignment> ';')* /END/ ;"
-			"strlist: /STORAGE/ (<variable> (','|';'))+ ;"
-			"varlist: /VARIABLES/ (<variable> (','|';'))+ ;"
-			"parlist: /PARAMETERS/ (<variable> (','|';'))+ ;"
-			"veclist: /VECTORS/ (<array> (','|';'))+ ;"
-			"system: /SYSTEM/ <variable> '('<integer>')' <varlist> <block> ;"
-			"declare: <parlist> | <varlist> | <veclist> | <strlist> ;"
-			"catastrophe : /^/ /CATASTROPHE/ <variable> (<declare>)+ (<system>)+ <block>'.' /$/ ;"
-			"function: <funcname> '(' <expression> (',' <expression>)* ')' ;",
-			Integer,
-			Float,
-			Expression,
-			Product,
-			Value,
-			Catastrophe,
-			Variable,
-			Array,
-			Leftside,
-			Assignment,
-			Block,
-			Varlist,
-			Parlist,
-			Veclist,
-			System,
-			Declare,
-			Function,
-			Funcname,
-			Strlist
-		 );
+/* The wavelang grammar, built once by build_grammar(). */
+const char *wavelang =
+	"integer \"integer\" : /[0-9]+/ ;"
+	"float \"float\" : /[0-9]*\\.?[0-9]+/ ;"
+	"variable \"variable\" : /[A-Za-z'_']+[A-Za-z0-9'_']*/ ;"
+	"funcname \"funcname\" : /[A-Za-z'_']+[A-Za-z0-9'_']*/ ;"
+	"array : <variable> '[' <expression> ']' ;"
+	"expression : <product> (('+' | '-') <product>)* ;"
+	"product : <value> (('*' | '/') <value>)* ;"
+	"value : '(' <expression> ')' | <float> | <integer> | <function> | <array> | <variable> ;"
+	"leftside : <array> | <variable> ;"
+	"assignment : <leftside> /<-/ <expression> ;"
+	"block : /BEGIN/ ^ (<assignment> ';')* /END/ ;"
+	"strlist: /STORAGE/ (<variable> (','|';'))+ ;"
+	"varlist: /VARIABLES/ (<variable> (','|';'))+ ;"
+	"parlist: /PARAMETERS/ (<variable> (','|';'))+ ;"
+	"veclist: /VECTORS/ (<array> (','|';'))+ ;"
+	"output: <variable> /<-/ <expression> ;"
+	"outlist: /OUTPUT/ (<output> (','|';'))+ ;"
+	"system: /SYSTEM/ ^ <variable> '('<integer>')' <varlist> <block> ;"
+	"declare: <parlist> | <varlist> | <veclist> | <strlist> | <outlist> ;"
+	"catastrophe : /^/ /CATASTROPHE/ <variable> (<declare>)+ (<system>)+ <block>'.' /$/ ;"
+	"function: <funcname> '(' <expression> (',' <expression>)* ')' ;";
+
+mpc_grammar_t *build_grammar(void)
+{
+	mpc_grammar_t *grammar;
+	mpc_err_t *err;
+
+	err = mpca_lang_grammar(MPCA_LANG_PACKRAT | MPCA_LANG_LEXER |
+			MPCA_LANG_COLLAPSE, wavelang, &grammar);
+	if (err) {
+		mpc_err_print(err);
+		mpc_err_delete(err);
+		return NULL;
+	}
+
+	return grammar;
+}
+
+#ifndef WLC_NO_BLOB
+#include "wavelang_blob.h"
+#endif
+
+/*
+ * The grammar is saved into wavelang_blob.h at build time by `wlc -g`, so
+ * normally it is loaded from there without parsing the text above again.
+ * A blob that doesn't load (saved by another mpc) falls back to building.
+ */
+mpc_grammar_t *load_grammar(void)
+{
+#ifndef WLC_NO_BLOB
+	mpc_grammar_t *grammar;
+
+	grammar = mpc_grammar_load((const char *)wavelang_blob,
+			sizeof(wavelang_blob));
+	if (grammar)
+		return grammar;
+#endif
+	return build_grammar();
+}
+
+int print_grammar_blob(void)
+{
+	mpc_grammar_t *grammar = build_grammar();
+	char *blob;
+	long len, i;
+
+	if (!grammar)
+		return 1;
+
+	if (!mpc_grammar_save(grammar, &blob, &len)) {
+		ERROR_PRINT("Unable to save the grammar!\n");
+		mpc_grammar_delete(grammar);
+		return 1;
+	}
+
+	printf("/* Generated by `wlc -g`, do not edit. */\n"
+		"static const unsigned char wavelang_blob[] = {");
+	for (i = 0; i < len; i++)
+		printf("%s%d,", i % 16 ? "" : "\n\t", (unsigned char)blob[i]);
+	printf("\n};\n");
+
+	free(blob);
+	mpc_grammar_delete(grammar);
+	return 0;
+}
 
+int parser(mpc_grammar_t *grammar, const char *input, size_t size)
+{
+	mpc_parser_t *Catastrophe = mpc_grammar_rule(grammar, "catastrophe");
+	mpc_context_t *context = mpc_context_new();
+	mpc_arena_t *arena = mpc_arena_new();
 	mpc_result_t result;
+	int ret = 0;
 
-	if (mpc_parse("stdin>", input, Catastrophe, &result)) {
+	/* The whole AST lives in the arena and goes away with it. */
+	if (mpc_parse_context("stdin>", input, size, context, arena,
+			Catastrophe, &result)) {
 		//mpc_ast_print(result.output);
 		gen_headers();
-		walk_ast(result.output);
-		mpc_ast_delete(result.output);
+		ret = walk_ast(result.output);
 		printf("\n\n");
 	} else {
 		mpc_err_print(result.error);
 		mpc_err_delete(result.error);
+		ret = -1;
+	}
+
+	mpc_arena_free(arena);
+	mpc_context_delete(context);
+
+	return ret;
+}
+
+void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-r] [-c] [-e] <file>\n"
+		"       %s -g\n"
+		"\t-r\tstore raw complex results, compute module/phase "
+		"in bulk\n"
+		"\t-c\tcache computed points on disk\n"
+		"\t-e\talso export evaluate_points() for scattered points\n"
+		"\t-g\tprint the built grammar as a C header and exit\n",
+		name, name);
+}
+
+char *read_stream(int fd, size_t *size)
+{
+	size_t cap = 4096;
+	char *buf, *tmp;
+	ssize_t ret;
+
+	*size = 0;
+	buf = malloc(cap);
+	if (!buf)
+		return NULL;
+
+	while ((ret = read(fd, buf + *size, cap - *size)) > 0) {
+		*size += ret;
+		if (*size < cap)
+			continue;
+
+		cap *= 2;
+		tmp = realloc(buf, cap);
+		if (!tmp) {
+			free(buf);
+			return NULL;
+		}
+		buf = tmp;
+	}
+
+	if (ret < 0) {
+		free(buf);
+		return NULL;
 	}
 
-	mpc_cleanup(19,
-			Integer,
-			Float,
-			Expression,
-			Product,
-			Value,
-			Catastrophe,
-			Variable,
-			Array,
-			Leftside,
-			Assignment,
-			Block,
-			Varlist,
-			Parlist,
-			Veclist,
-			System,
-			Declare,
-			Function,
-			Funcname,
-			Strlist
-		   );
+	return buf;
 }
 
 int main(int argc, char *argv[])
 {
+	struct stat st;
+	mpc_grammar_t *grammar;
 	char *content;
 	size_t size;
-	FILE *fp;
+	int fd, opt, mapped, ret;
+
+	while ((opt = getopt(argc, argv, "rceg")) != -1) {
+		switch (opt) {
+		case 'g':
+			return print_grammar_blob();
+		case 'r':
+			raw_output = 1;
+			break;
+		case 'c':
+			result_cache = 1;
+			break;
+		case 'e':
+			batch_eval = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
 
-	if (argc != 2) {
+	if (optind != argc - 1) {
 		ERROR_PRINT("At least one argument is necessary!\n");
+		usage(argv[0]);
 		return 1;
 	}
 
-	fp = fopen(argv[1], "r");
-	if (!fp) {
-		ERROR_PRINT("Unable to open file: %s!\n", argv[1]);
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		ERROR_PRINT("Unable to open file: %s!\n", argv[optind]);
 		return 1;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	size = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-
-	content = malloc(size + 1);
-	if (!content) {
-		ERROR_PRINT("Unable to allocate memory for file contents!\n");
+	if (fstat(fd, &st)) {
+		ERROR_PRINT("Unable to stat file: %s!\n", argv[optind]);
 		return 1;
 	}
 
-	fread(content, size, 1, fp);
-	content[size] = 0;
-	fclose(fp);
+	/*
+	 * Regular files are mapped and parsed in place, no copy is made.
+	 * Anything else (pipes, terminals) has to be read in first.
+	 */
+	mapped = S_ISREG(st.st_mode) && st.st_size;
+	if (mapped) {
+		size = st.st_size;
+		content = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (content == MAP_FAILED) {
+			ERROR_PRINT("Unable to map file: %s!\n", argv[optind]);
+			return 1;
+		}
+	} else {
+		content = read_stream(fd, &size);
+		if (!content) {
+			ERROR_PRINT("Unable to read file: %s!\n", argv[optind]);
+			return 1;
+		}
+	}
+	close(fd);
+
+	/* Options that change the generated numbers are part of the hash. */
+	catastrophe_hash = fnv1a(content, size, 0xcbf29ce484222325ULL);
+	catastrophe_hash = fnv1a(&raw_output, sizeof(raw_output),
+			catastrophe_hash);
+	catastrophe_hash = fnv1a("double complex", 14, catastrophe_hash);
+	/* So are the tile layout and the way slots are published. */
+	catastrophe_hash = fnv1a("tile v3", 7, catastrophe_hash);
+
+	grammar = load_grammar();
+	if (!grammar)
+		return 1;
 
-	parser(content);
+	ret = parser(grammar, content, size);
+	mpc_grammar_delete(grammar);
+	mpc_intern_cleanup();
 
-	return 0;
+	if (mapped)
+		munmap(content, size);
+	else
+		free(content);
+
+	return ret ? 1 : 0;
 }